@@ -3,8 +3,276 @@
 
 #include <string.h>
 
+#ifdef moonfish_debug
+#include <stdio.h>
+#include <stdlib.h>
+#endif
+
 #include "moonfish.h"
 
+/* mailbox deltas for each direction (positive ones first, then their opposites in the same order) */
+static int moonfish_directions[] = {10, 1, 11, 9, -10, -1, -11, -9};
+
+/* conversion tables between square indices (0..63) and board indices (21..98) */
+static unsigned char moonfish_indices[64];
+static unsigned char moonfish_squares[120];
+
+/* squares attacked by a piece (or a pawn of each color) on a given square */
+static moonfish_bitboard moonfish_knight_attacks[64];
+static moonfish_bitboard moonfish_king_attacks[64];
+static moonfish_bitboard moonfish_pawn_attacks[2][64];
+
+/* squares reached by sliding from a given square in a given direction (until the edge of the board) */
+static moonfish_bitboard moonfish_rays[8][64];
+
+/* random keys for Zobrist hashing */
+/* (for each piece on each square, for each castling right, for each e.p. square, and for black's turn) */
+static moonfish_bitboard moonfish_piece_keys[2][7][64];
+static moonfish_bitboard moonfish_castling_keys[4];
+static moonfish_bitboard moonfish_passing_keys[64];
+static moonfish_bitboard moonfish_black_key;
+
+/* piece-square values for the middlegame and for the endgame */
+/* (indexed by "x + y * 4 + type * 32", where "x" is mirrored to the queen side, and "y" is from the player's perspective) */
+static short int moonfish_values0[] = {0, 0, 0, 0, 56, 96, 84, 65, 61, 92, 74, 79, 58, 88, 83, 95, 69, 102, 96, 115, 82, 132, 156, 159, 258, 226, 262, 274, 0, 0, 0, 0, 262, 317, 317, 310, 323, 314, 337, 344, 321, 350, 356, 367, 341, 370, 371, 371, 366, 368, 406, 398, 361, 399, 433, 442, 338, 329, 420, 402, 194, 295, 237, 363, 356, 375, 360, 346, 382, 394, 396, 378, 386, 393, 387, 395, 382, 390, 392, 414, 380, 397, 421, 430, 406, 429, 426, 440, 374, 391, 413, 395, 343, 339, 291, 298, 456, 467, 469, 477, 427, 460, 462, 465, 440, 462, 447, 458, 447, 457, 454, 469, 474, 484, 496, 513, 491, 529, 533, 548, 523, 521, 552, 552, 564, 550, 535, 552, 1046, 1032, 1038, 1058, 1046, 1062, 1070, 1058, 1049, 1063, 1056, 1052, 1047, 1056, 1051, 1046, 1073, 1053, 1058, 1057, 1078, 1083, 1077, 1071, 1049, 1001, 1063, 1041, 1057, 1071, 1089, 1107, 20, 37, -21, -15, 18, 4, -61, -82, -63, -50, -84, -97, -93, -68, -82, -97, -77, -40, -24, -40, -31, 28, 52, 36, 44, 13, 53, 63, 163, 141, 61, 70};
+static short int moonfish_values1[] = {0, 0, 0, 0, 137, 142, 141, 145, 132, 137, 127, 134, 139, 138, 123, 119, 156, 152, 134, 125, 223, 214, 184, 178, 255, 269, 236, 215, 0, 0, 0, 0, 320, 318, 360, 369, 345, 378, 378, 387, 360, 388, 396, 416, 384, 403, 428, 436, 388, 413, 430, 439, 376, 396, 414, 416, 362, 399, 385, 408, 317, 372, 415, 387, 389, 391, 391, 410, 393, 402, 404, 420, 402, 416, 431, 431, 410, 429, 436, 437, 420, 437, 431, 440, 412, 421, 431, 425, 399, 420, 418, 423, 409, 418, 423, 430, 699, 708, 715, 717, 706, 704, 709, 708, 705, 712, 718, 716, 724, 732, 737, 734, 737, 740, 743, 738, 744, 738, 742, 734, 742, 749, 743, 746, 727, 736, 744, 738, 1255, 1256, 1247, 1234, 1248, 1249, 1246, 1271, 1276, 1274, 1307, 1305, 1308, 1332, 1342, 1359, 1309, 1358, 1374, 1384, 1318, 1333, 1375, 1386, 1327, 1388, 1381, 1410, 1338, 1346, 1357, 1352, -71, -42, -29, -42, -27, -11, 12, 17, -3, 12, 30, 39, 8, 30, 45, 55, 21, 48, 49, 52, 29, 49, 42, 30, -7, 42, 27, 10, -95, -30, -17, -26};
+
+/* how much each piece type counts towards the game phase (24 means middlegame, 0 means endgame) */
+static int moonfish_phases[] = {0, 1, 1, 2, 4, 0};
+
+/* the piece-square values above for each piece on each square (negated for black), along with its phase */
+/* these are packed into three 16-bit lanes (middlegame value, endgame value, phase) so that they can all be added at once */
+/* (note: the lanes are two's complement, so a negative lane borrows one from the lane above it) */
+static moonfish_bitboard moonfish_square_scores[2][7][64];
+
+#ifdef __GNUC__
+
+#define moonfish_first(bitboard) __builtin_ctzll(bitboard)
+#define moonfish_last(bitboard) (__builtin_clzll(bitboard) ^ 63)
+
+#else
+
+static unsigned char moonfish_scan[64];
+
+static moonfish_bitboard moonfish_debruijn(void)
+{
+	return (moonfish_bitboard) 0x03F79D71 << 32 | 0xB4CB0A89;
+}
+
+static int moonfish_first(moonfish_bitboard bitboard)
+{
+	return moonfish_scan[(bitboard & -bitboard) * moonfish_debruijn() >> 58];
+}
+
+static int moonfish_last(moonfish_bitboard bitboard)
+{
+	bitboard |= bitboard >> 1;
+	bitboard |= bitboard >> 2;
+	bitboard |= bitboard >> 4;
+	bitboard |= bitboard >> 8;
+	bitboard |= bitboard >> 16;
+	bitboard |= bitboard >> 32;
+	return moonfish_first(bitboard ^ bitboard >> 1);
+}
+
+#endif
+
+static moonfish_bitboard moonfish_steps(int index, int *deltas, int count)
+{
+	moonfish_bitboard bitboard;
+	int i;
+	
+	bitboard = 0;
+	for (i = 0 ; i < count ; i++) {
+		if (moonfish_squares[index + deltas[i]] == 0xFF) continue;
+		bitboard |= (moonfish_bitboard) 1 << moonfish_squares[index + deltas[i]];
+	}
+	
+	return bitboard;
+}
+
+/* xorshift pseudorandom number generator (so that the keys are the same in every run) */
+static moonfish_bitboard moonfish_random(moonfish_bitboard *state)
+{
+	*state ^= *state << 13;
+	*state ^= *state >> 7;
+	*state ^= *state << 17;
+	return *state;
+}
+
+static moonfish_bitboard moonfish_pack(int score0, int score1, int phase)
+{
+	return ((moonfish_bitboard) score0 << 32) + ((moonfish_bitboard) score1 << 16) + phase;
+}
+
+/* extracts the lowest lane of a packed score (as a signed integer) */
+static int moonfish_lane(moonfish_bitboard score)
+{
+	score &= 0xFFFF;
+	if (score >= 0x8000) return (int) score - 0x10000;
+	return score;
+}
+
+static void moonfish_tables(void)
+{
+	static int knight_deltas[] = {21, 19, 12, 8, -21, -19, -12, -8};
+	static int white_pawn_deltas[] = {11, 9};
+	static int black_pawn_deltas[] = {-11, -9};
+	static int done = 0;
+	
+	int square, index, i, j;
+	moonfish_bitboard state;
+	
+	if (done) return;
+	
+	state = 0x6D6F6F6E;
+	
+	for (i = 0 ; i < 120 ; i++) moonfish_squares[i] = 0xFF;
+	
+	for (square = 0 ; square < 64 ; square++) {
+		index = (square % 8 + 1) + (square / 8 + 2) * 10;
+		moonfish_indices[square] = index;
+		moonfish_squares[index] = square;
+#ifndef __GNUC__
+		moonfish_scan[((moonfish_bitboard) 1 << square) * moonfish_debruijn() >> 58] = square;
+#endif
+	}
+	
+	for (square = 0 ; square < 64 ; square++) {
+		
+		index = moonfish_indices[square];
+		
+		moonfish_knight_attacks[square] = moonfish_steps(index, knight_deltas, 8);
+		moonfish_king_attacks[square] = moonfish_steps(index, moonfish_directions, 8);
+		moonfish_pawn_attacks[0][square] = moonfish_steps(index, white_pawn_deltas, 2);
+		moonfish_pawn_attacks[1][square] = moonfish_steps(index, black_pawn_deltas, 2);
+		
+		for (i = 0 ; i < 7 ; i++) {
+			moonfish_piece_keys[0][i][square] = moonfish_random(&state);
+			moonfish_piece_keys[1][i][square] = moonfish_random(&state);
+		}
+		
+		moonfish_passing_keys[square] = moonfish_random(&state);
+		
+		for (i = 1 ; i < 7 ; i++) {
+			j = (square % 8 > 3 ? 7 - square % 8 : square % 8) + square / 8 * 4 + (i - 1) * 32;
+			moonfish_square_scores[0][i][square] = moonfish_pack(moonfish_values0[j], moonfish_values1[j], moonfish_phases[i - 1]);
+			j = (square % 8 > 3 ? 7 - square % 8 : square % 8) + (7 - square / 8) * 4 + (i - 1) * 32;
+			moonfish_square_scores[1][i][square] = moonfish_pack(-moonfish_values0[j], -moonfish_values1[j], moonfish_phases[i - 1]);
+		}
+		
+		for (i = 0 ; i < 8 ; i++) {
+			moonfish_rays[i][square] = 0;
+			for (j = index + moonfish_directions[i] ; moonfish_squares[j] != 0xFF ; j += moonfish_directions[i]) {
+				moonfish_rays[i][square] |= (moonfish_bitboard) 1 << moonfish_squares[j];
+			}
+		}
+	}
+	
+	for (i = 0 ; i < 4 ; i++) moonfish_castling_keys[i] = moonfish_random(&state);
+	moonfish_black_key = moonfish_random(&state);
+	
+	done = 1;
+}
+
+/* squares reached by sliding in the given direction, stopping at the first occupied square (inclusive) */
+static moonfish_bitboard moonfish_ray(int direction, int square, moonfish_bitboard occupied)
+{
+	moonfish_bitboard ray, blockers;
+	
+	ray = moonfish_rays[direction][square];
+	blockers = ray & occupied;
+	if (blockers == 0) return ray;
+	
+	if (direction < 4) return ray ^ moonfish_rays[direction][moonfish_first(blockers)];
+	return ray ^ moonfish_rays[direction][moonfish_last(blockers)];
+}
+
+static moonfish_bitboard moonfish_bishop_attacks(int square, moonfish_bitboard occupied)
+{
+	return moonfish_ray(2, square, occupied) | moonfish_ray(3, square, occupied) | moonfish_ray(6, square, occupied) | moonfish_ray(7, square, occupied);
+}
+
+static moonfish_bitboard moonfish_rook_attacks(int square, moonfish_bitboard occupied)
+{
+	return moonfish_ray(0, square, occupied) | moonfish_ray(1, square, occupied) | moonfish_ray(4, square, occupied) | moonfish_ray(5, square, occupied);
+}
+
+/* sets the piece on the square with the given index, keeping the bitboards and the hash in sync */
+static void moonfish_set(struct moonfish_chess *chess, int index, int piece)
+{
+	moonfish_bitboard bit;
+	int old, square;
+	
+	square = moonfish_squares[index];
+	bit = (moonfish_bitboard) 1 << square;
+	old = chess->board[index];
+	
+	if (old != moonfish_empty) {
+		chess->bitboards[old / 16 - 1][0] ^= bit;
+		chess->bitboards[old / 16 - 1][old % 16] ^= bit;
+		chess->hash ^= moonfish_piece_keys[old / 16 - 1][old % 16][square];
+		chess->score -= moonfish_square_scores[old / 16 - 1][old % 16][square];
+	}
+	
+	if (piece != moonfish_empty) {
+		chess->bitboards[piece / 16 - 1][0] |= bit;
+		chess->bitboards[piece / 16 - 1][piece % 16] |= bit;
+		chess->hash ^= moonfish_piece_keys[piece / 16 - 1][piece % 16][square];
+		chess->score += moonfish_square_scores[piece / 16 - 1][piece % 16][square];
+	}
+	
+	chess->board[index] = piece;
+}
+
+/* hash of the parts of the position that aren't pieces (castling rights, e.p. square, and turn) */
+/* the e.p. square only counts when a pawn could capture on it (so that the hash doesn't depend on whether the last move was a double push otherwise) */
+/* (note: this depends on the pieces, so it must be computed after the bitboards are up to date) */
+static moonfish_bitboard moonfish_flags_hash(struct moonfish_chess *chess)
+{
+	moonfish_bitboard hash;
+	int color;
+	
+	hash = 0;
+	if (chess->oo[0]) hash ^= moonfish_castling_keys[0];
+	if (chess->oo[1]) hash ^= moonfish_castling_keys[1];
+	if (chess->ooo[0]) hash ^= moonfish_castling_keys[2];
+	if (chess->ooo[1]) hash ^= moonfish_castling_keys[3];
+	if (chess->passing != 0) {
+		color = chess->white ? 0 : 1;
+		if (moonfish_pawn_attacks[color ^ 1][moonfish_squares[chess->passing]] & chess->bitboards[color][moonfish_pawn]) {
+			hash ^= moonfish_passing_keys[moonfish_squares[chess->passing]];
+		}
+	}
+	if (!chess->white) hash ^= moonfish_black_key;
+	
+	return hash;
+}
+
+/* recomputes the bitboards and the hash from the board */
+static void moonfish_recompute(struct moonfish_chess *chess)
+{
+	int square, i, piece;
+	
+	moonfish_tables();
+	
+	for (i = 0 ; i < 7 ; i++) {
+		chess->bitboards[0][i] = 0;
+		chess->bitboards[1][i] = 0;
+	}
+	
+	chess->hash = 0;
+	chess->score = 0;
+	
+	for (square = 0 ; square < 64 ; square++) {
+		piece = chess->board[moonfish_indices[square]];
+		chess->board[moonfish_indices[square]] = moonfish_empty;
+		if (piece != moonfish_empty) moonfish_set(chess, moonfish_indices[square], piece);
+	}
+	
+	chess->hash ^= moonfish_flags_hash(chess);
+}
+
 static void moonfish_force_promotion(struct moonfish_move **moves, int from, int to, int piece)
 {
 	(*moves)->from = from;
@@ -18,76 +286,83 @@ static void moonfish_force_move(struct moonfish_move **moves, int from, int to,
 	moonfish_force_promotion(moves, from, to, chess->board[from]);
 }
 
-static void moonfish_deltas(struct moonfish_chess *chess, struct moonfish_move **moves, int from, int *deltas, int count, int n)
+static void moonfish_targets(struct moonfish_chess *chess, struct moonfish_move **moves, int from, moonfish_bitboard targets)
 {
-	int i;
-	int to;
-	
-	while (*deltas) {
-		to = from;
-		for (i = 0 ; i < count ; i++) {
-			to += *deltas * n;
-			if (chess->board[to] == moonfish_outside) break;
-			if (chess->board[to] / 16 == chess->board[from] / 16) break;
-			moonfish_force_move(moves, from, to, chess);
-			if (chess->board[to] != moonfish_empty) break;
-		}
-		deltas++;
+	while (targets != 0) {
+		moonfish_force_move(moves, from, moonfish_indices[moonfish_first(targets)], chess);
+		targets &= targets - 1;
 	}
 }
 
-int moonfish_moves(struct moonfish_chess *chess, struct moonfish_move *moves, int from);
+/* squares attacked by a (non-pawn) piece of the given type on the given square */
+static moonfish_bitboard moonfish_piece_attacks(int type, int square, moonfish_bitboard occupied)
+{
+	switch (type) {
+	case moonfish_knight:
+		return moonfish_knight_attacks[square];
+	case moonfish_bishop:
+		return moonfish_bishop_attacks(square, occupied);
+	case moonfish_rook:
+		return moonfish_rook_attacks(square, occupied);
+	case moonfish_queen:
+		return moonfish_bishop_attacks(square, occupied) | moonfish_rook_attacks(square, occupied);
+	case moonfish_king:
+		return moonfish_king_attacks[square];
+	}
+	return 0;
+}
 
-int moonfish_validate(struct moonfish_chess *chess)
+/* returns whether the square (0..63) is attacked by any piece of the given color (given which squares are occupied) */
+static int moonfish_attacked(struct moonfish_chess *chess, int square, int color, moonfish_bitboard occupied)
 {
-	int x, y;
-	struct moonfish_move moves[32];
-	int i, count;
+	moonfish_bitboard *bitboards;
 	
-	for (y = 0 ; y < 8 ; y++) {
-		for (x = 0 ; x < 8 ; x++) {
-			count = moonfish_moves(chess, moves, (x + 1) + (y + 2) * 10);
-			for (i = 0 ; i < count ; i++) {
-				if (chess->board[moves[i].to] % 16 == moonfish_king) return 0;
-			}
-		}
+	bitboards = chess->bitboards[color];
+	
+	if (moonfish_knight_attacks[square] & bitboards[moonfish_knight]) return 1;
+	if (moonfish_pawn_attacks[color ^ 1][square] & bitboards[moonfish_pawn]) return 1;
+	if (moonfish_king_attacks[square] & bitboards[moonfish_king]) return 1;
+	
+	if (bitboards[moonfish_bishop] | bitboards[moonfish_queen]) {
+		if (moonfish_bishop_attacks(square, occupied) & (bitboards[moonfish_bishop] | bitboards[moonfish_queen])) return 1;
 	}
 	
-	return 1;
+	if (bitboards[moonfish_rook] | bitboards[moonfish_queen]) {
+		if (moonfish_rook_attacks(square, occupied) & (bitboards[moonfish_rook] | bitboards[moonfish_queen])) return 1;
+	}
+	
+	return 0;
 }
 
-int moonfish_check(struct moonfish_chess *chess)
+int moonfish_validate(struct moonfish_chess *chess)
 {
-	struct moonfish_chess other;
-	
-	other = *chess;
-	other.passing = 0;
-	other.oo[0] = 0;
-	other.oo[1] = 0;
-	other.ooo[0] = 0;
-	other.ooo[1] = 0;
-	other.white ^= 1;
-	return moonfish_validate(&other) ^ 1;
+	moonfish_bitboard king;
+	king = chess->bitboards[chess->white][moonfish_king];
+	if (king == 0) return 1;
+	return moonfish_attacked(chess, moonfish_first(king), chess->white ^ 1, chess->bitboards[0][0] | chess->bitboards[1][0]) ^ 1;
 }
 
-static int moonfish_attacked(struct moonfish_chess *chess, int from, int to)
+int moonfish_check(struct moonfish_chess *chess)
 {
-	struct moonfish_chess other;
-	other = *chess;
-	other.board[from] = moonfish_empty;
-	other.board[to] = chess->white ? moonfish_white_king : moonfish_black_king;
-	return moonfish_check(&other);
+	moonfish_bitboard king;
+	king = chess->bitboards[chess->white ^ 1][moonfish_king];
+	if (king == 0) return 0;
+	return moonfish_attacked(chess, moonfish_first(king), chess->white, chess->bitboards[0][0] | chess->bitboards[1][0]);
 }
 
-static void moonfish_castle(struct moonfish_chess *chess, struct moonfish_move **moves, int from, int to, int dy)
+static void moonfish_castle(struct moonfish_chess *chess, struct moonfish_move **moves, int from, int to, int dy, int legal)
 {
+	moonfish_bitboard occupied;
+	
 	while (to != from) {
 		if (chess->board[to] != moonfish_empty) return;
 		to -= dy;
 	}
 	
-	if (moonfish_check(chess)) return;
-	if (moonfish_attacked(chess, from, from + dy)) return;
+	occupied = chess->bitboards[0][0] | chess->bitboards[1][0];
+	if (moonfish_attacked(chess, moonfish_squares[from], chess->white, occupied)) return;
+	if (moonfish_attacked(chess, moonfish_squares[from + dy], chess->white, occupied)) return;
+	if (legal && moonfish_attacked(chess, moonfish_squares[from + dy * 2], chess->white, occupied)) return;
 	moonfish_force_move(moves, from, from + dy * 2, chess);
 }
 
@@ -107,65 +382,193 @@ static void moonfish_pawn_moves(struct moonfish_chess *chess, struct moonfish_mo
 	moonfish_force_promotion(moves, from, to, color | moonfish_knight);
 }
 
-static void moonfish_pawn_capture(struct moonfish_chess *chess, struct moonfish_move **moves, int from, int to)
-{
-	if (to == chess->passing) {
-		moonfish_force_move(moves, from, to, chess);
-		return;
-	}
-	
-	if (chess->board[to] / 16 != chess->board[from] / 16 && chess->board[to] != moonfish_empty && chess->board[to] != moonfish_outside) {
-		moonfish_pawn_moves(chess, moves, from, to);
-	}
-}
+void moonfish_play(struct moonfish_chess *chess, struct moonfish_move *move);
 
-static void moonfish_move_pawn(struct moonfish_chess *chess, struct moonfish_move **moves, int from)
+/* generates pawn moves whose destination is within "mask" */
+/* when "legal" is set, e.p. captures are only generated if they don't leave the king in check */
+static void moonfish_move_pawn(struct moonfish_chess *chess, struct moonfish_move **moves, int from, int color, moonfish_bitboard mask, int legal)
 {
 	int dy;
+	moonfish_bitboard targets;
+	struct moonfish_chess other;
 	
 	dy = chess->white ? 10 : -10;
 	
 	if (chess->board[from + dy] == moonfish_empty) {
-		moonfish_pawn_moves(chess, moves, from, from + dy);
+		if (mask & (moonfish_bitboard) 1 << moonfish_squares[from + dy]) moonfish_pawn_moves(chess, moves, from, from + dy);
 		if ((chess->white ? from < 40 : from > 80) && chess->board[from + dy * 2] == moonfish_empty) {
-			moonfish_force_move(moves, from, from + dy * 2, chess);
+			if (mask & (moonfish_bitboard) 1 << moonfish_squares[from + dy * 2]) moonfish_force_move(moves, from, from + dy * 2, chess);
 		}
 	}
 	
-	moonfish_pawn_capture(chess, moves, from, from + dy + 1);
-	moonfish_pawn_capture(chess, moves, from, from + dy - 1);
+	targets = moonfish_pawn_attacks[color][moonfish_squares[from]];
+	
+	if (chess->passing != 0 && targets & (moonfish_bitboard) 1 << moonfish_squares[chess->passing]) {
+		moonfish_force_move(moves, from, chess->passing, chess);
+		if (legal) {
+			other = *chess;
+			moonfish_play(&other, *moves - 1);
+			if (!moonfish_validate(&other)) (*moves)--;
+		}
+	}
+	
+	targets &= chess->bitboards[color ^ 1][0] & mask;
+	
+	while (targets != 0) {
+		moonfish_pawn_moves(chess, moves, from, moonfish_indices[moonfish_first(targets)]);
+		targets &= targets - 1;
+	}
 }
 
 int moonfish_moves(struct moonfish_chess *chess, struct moonfish_move *moves, int from)
 {
-	static int steps[] = {0, 1, 8, 8, 8, 1};
-	static int deltas[][5] = {
-		{0},
-		{21, 19, 12, 8, 0},
-		{11, 9, 0},
-		{10, 1, 0},
-		{10, 1, 11, 9, 0},
-		{10, 1, 11, 9, 0},
-	};
-	
 	struct moonfish_move *moves0;
-	int piece;
+	int piece, color, square;
+	moonfish_bitboard occupied;
 	
 	moves0 = moves;
 	piece = chess->board[from];
 	
 	if (chess->white ? piece / 16 != 1 : piece / 16 != 2) return 0;
 	
-	moonfish_deltas(chess, &moves, from, deltas[piece % 16 - 1], steps[piece % 16 - 1], 1);
-	moonfish_deltas(chess, &moves, from, deltas[piece % 16 - 1], steps[piece % 16 - 1], -1);
+	color = chess->white ^ 1;
+	square = moonfish_squares[from];
+	occupied = chess->bitboards[0][0] | chess->bitboards[1][0];
 	
 	if (piece % 16 == moonfish_pawn) {
-		moonfish_move_pawn(chess, &moves, from);
+		moonfish_move_pawn(chess, &moves, from, color, ~(moonfish_bitboard) 0, 0);
+		return moves - moves0;
 	}
 	
+	moonfish_targets(chess, &moves, from, moonfish_piece_attacks(piece % 16, square, occupied) & ~chess->bitboards[color][0]);
+	
 	if (piece % 16 == moonfish_king) {
-		if (chess->oo[chess->white ^ 1]) moonfish_castle(chess, &moves, from, from + 2, 1);
-		if (chess->ooo[chess->white ^ 1]) moonfish_castle(chess, &moves, from, from - 3, -1);
+		if (chess->oo[color]) moonfish_castle(chess, &moves, from, from + 2, 1, 0);
+		if (chess->ooo[color]) moonfish_castle(chess, &moves, from, from - 3, -1, 0);
+	}
+	
+	return moves - moves0;
+}
+
+int moonfish_all_moves(struct moonfish_chess *chess, struct moonfish_move *moves, int max)
+{
+	struct moonfish_move buffer[32];
+	moonfish_bitboard pieces;
+	int i, count, total;
+	
+	pieces = chess->bitboards[chess->white ^ 1][0];
+	total = 0;
+	
+	while (pieces != 0) {
+		count = moonfish_moves(chess, buffer, moonfish_indices[moonfish_first(pieces)]);
+		pieces &= pieces - 1;
+		for (i = 0 ; i < count && total < max ; i++) moves[total++] = buffer[i];
+	}
+	
+	return total;
+}
+
+int moonfish_legal_moves(struct moonfish_chess *chess, struct moonfish_move *moves)
+{
+	struct moonfish_move *moves0;
+	moonfish_bitboard *bitboards, own, occupied, sliders, ray, beyond, blocker, bit;
+	moonfish_bitboard checkers, evasions, pinned, mask, pieces, targets;
+	moonfish_bitboard pins[8];
+	int color, king, square, from, type, i;
+	
+	moves0 = moves;
+	color = chess->white ^ 1;
+	own = chess->bitboards[color][0];
+	occupied = own | chess->bitboards[color ^ 1][0];
+	bitboards = chess->bitboards[color ^ 1];
+	
+	if (chess->bitboards[color][moonfish_king] == 0) return moonfish_all_moves(chess, moves, 256);
+	
+	king = moonfish_first(chess->bitboards[color][moonfish_king]);
+	
+	/* find checkers and pinned pieces by looking outward from the king */
+	
+	checkers = moonfish_knight_attacks[king] & bitboards[moonfish_knight];
+	checkers |= moonfish_pawn_attacks[color][king] & bitboards[moonfish_pawn];
+	evasions = checkers;
+	pinned = 0;
+	
+	for (i = 0 ; i < 8 ; i++) {
+		
+		pins[i] = 0;
+		
+		if (i % 4 < 2) sliders = bitboards[moonfish_rook] | bitboards[moonfish_queen];
+		else sliders = bitboards[moonfish_bishop] | bitboards[moonfish_queen];
+		
+		if ((moonfish_rays[i][king] & sliders) == 0) continue;
+		
+		ray = moonfish_ray(i, king, occupied);
+		
+		if (ray & sliders) {
+			checkers |= ray & sliders;
+			evasions |= ray;
+			continue;
+		}
+		
+		blocker = ray & own;
+		if (blocker == 0) continue;
+		
+		beyond = moonfish_ray(i, moonfish_first(blocker), occupied);
+		if ((beyond & sliders) == 0) continue;
+		
+		pinned |= blocker;
+		pins[i] = ray | beyond;
+	}
+	
+	/* king moves (the king must be removed from the occupancy to see through it) */
+	
+	from = moonfish_indices[king];
+	targets = moonfish_king_attacks[king] & ~own;
+	
+	while (targets != 0) {
+		square = moonfish_first(targets);
+		targets &= targets - 1;
+		if (moonfish_attacked(chess, square, color ^ 1, occupied ^ (moonfish_bitboard) 1 << king)) continue;
+		moonfish_force_move(&moves, from, moonfish_indices[square], chess);
+	}
+	
+	if (checkers == 0) {
+		if (chess->oo[color]) moonfish_castle(chess, &moves, from, from + 2, 1, 1);
+		if (chess->ooo[color]) moonfish_castle(chess, &moves, from, from - 3, -1, 1);
+		evasions = ~(moonfish_bitboard) 0;
+	}
+	else if (checkers & (checkers - 1)) {
+		/* double check (only the king may move) */
+		return moves - moves0;
+	}
+	
+	/* other pieces (which may only move to block or capture a checker, and only along the pin ray if pinned) */
+	
+	pieces = own ^ (moonfish_bitboard) 1 << king;
+	
+	while (pieces != 0) {
+		
+		square = moonfish_first(pieces);
+		bit = pieces & -pieces;
+		pieces ^= bit;
+		
+		from = moonfish_indices[square];
+		type = chess->board[from] % 16;
+		
+		mask = evasions;
+		if (pinned & bit) {
+			for (i = 0 ; i < 8 ; i++) {
+				if (pins[i] & bit) break;
+			}
+			mask &= pins[i];
+		}
+		
+		if (type == moonfish_pawn) {
+			moonfish_move_pawn(chess, &moves, from, color, mask, 1);
+			continue;
+		}
+		
+		moonfish_targets(chess, &moves, from, moonfish_piece_attacks(type, square, occupied) & ~own & mask);
 	}
 	
 	return moves - moves0;
@@ -176,12 +579,17 @@ void moonfish_play(struct moonfish_chess *chess, struct moonfish_move *move)
 	int dy;
 	int passing;
 	
+	chess->hash ^= moonfish_flags_hash(chess);
+	
 	passing = chess->passing;
 	chess->passing = 0;
 	
+	chess->clock++;
+	if (move->piece % 16 == moonfish_pawn || chess->board[move->to] != moonfish_empty) chess->clock = 0;
+	
 	if (move->piece % 16 == moonfish_pawn) {
 		dy = chess->white ? 10 : -10;
-		if (move->to == passing) chess->board[move->to - dy] = moonfish_empty;
+		if (move->to == passing) moonfish_set(chess, move->to - dy, moonfish_empty);
 		if (move->to - move->from == dy * 2) chess->passing = move->to - dy;
 	}
 	
@@ -189,12 +597,12 @@ void moonfish_play(struct moonfish_chess *chess, struct moonfish_move *move)
 		chess->oo[chess->white ^ 1] = 0;
 		chess->ooo[chess->white ^ 1] = 0;
 		if (move->to - move->from == 2) {
-			chess->board[move->to - 1] = chess->board[move->to + 1];
-			chess->board[move->to + 1] = moonfish_empty;
+			moonfish_set(chess, move->to - 1, chess->board[move->to + 1]);
+			moonfish_set(chess, move->to + 1, moonfish_empty);
 		}
 		if (move->to - move->from == -2) {
-			chess->board[move->to + 1] = chess->board[move->to - 2];
-			chess->board[move->to - 2] = moonfish_empty;
+			moonfish_set(chess, move->to + 1, chess->board[move->to - 2]);
+			moonfish_set(chess, move->to - 2, moonfish_empty);
 		}
 	}
 	
@@ -203,9 +611,11 @@ void moonfish_play(struct moonfish_chess *chess, struct moonfish_move *move)
 	if (move->from == 21 || move->to == 21) chess->ooo[0] = 0;
 	if (move->from == 91 || move->to == 91) chess->ooo[1] = 0;
 	
-	chess->board[move->from] = moonfish_empty;
-	chess->board[move->to] = move->piece;
+	moonfish_set(chess, move->from, moonfish_empty);
+	moonfish_set(chess, move->to, move->piece);
 	chess->white ^= 1;
+	
+	chess->hash ^= moonfish_flags_hash(chess);
 }
 
 void moonfish_chess(struct moonfish_chess *chess)
@@ -219,6 +629,7 @@ void moonfish_chess(struct moonfish_chess *chess)
 	chess->ooo[0] = 1;
 	chess->ooo[1] = 1;
 	chess->passing = 0;
+	chess->clock = 0;
 	
 	for (x = 0 ; x < 120 ; x++) chess->board[x] = moonfish_outside;
 	
@@ -229,6 +640,8 @@ void moonfish_chess(struct moonfish_chess *chess)
 		chess->board[x + 81] = moonfish_black_pawn;
 		for (y = 4 ; y < 8 ; y++) chess->board[(x + 1) + y * 10] = moonfish_empty;
 	}
+	
+	moonfish_recompute(chess);
 }
 
 /* note: this function does not assume ASCII */
@@ -265,8 +678,7 @@ void moonfish_to_uci(struct moonfish_chess *chess, struct moonfish_move *move, c
 
 int moonfish_from_uci(struct moonfish_chess *chess, struct moonfish_move *move, char *name0)
 {
-	struct moonfish_move moves[32];
-	int x, y;
+	struct moonfish_move moves[256];
 	int i, count;
 	char name[6];
 	
@@ -281,16 +693,12 @@ int moonfish_from_uci(struct moonfish_chess *chess, struct moonfish_move *move,
 	}
 #endif
 	
-	for (y = 0 ; y < 8 ; y++) {
-		for (x = 0 ; x < 8 ; x++) {
-			count = moonfish_moves(chess, moves, (x + 1) + (y + 2) * 10);
-			for (i = 0 ; i < count ; i++) {
-				moonfish_to_uci(chess, moves + i, name);
-				if (!strcmp(name, name0)) {
-					*move = moves[i];
-					return 0;
-				}
-			}
+	count = moonfish_all_moves(chess, moves, 256);
+	for (i = 0 ; i < count ; i++) {
+		moonfish_to_uci(chess, moves + i, name);
+		if (!strcmp(name, name0)) {
+			*move = moves[i];
+			return 0;
 		}
 	}
 	
@@ -301,6 +709,7 @@ int moonfish_equal(struct moonfish_chess *a, struct moonfish_chess *b)
 {
 	int x, y, i;
 	
+	if (a->hash != b->hash) return 0;
 	if (a->white != b->white) return 0;
 	if (a->passing != b->passing) return 0;
 	if (a->oo[0] != b->oo[0]) return 0;
@@ -326,23 +735,8 @@ int moonfish_equal(struct moonfish_chess *a, struct moonfish_chess *b)
 
 int moonfish_finished(struct moonfish_chess *chess)
 {
-	struct moonfish_move moves[32];
-	int x, y;
-	int i, count;
-	struct moonfish_chess other;
-	
-	for (y = 0 ; y < 8 ; y++) {
-		for (x = 0 ; x < 8 ; x++) {
-			count = moonfish_moves(chess, moves, (x + 1) + (y + 2) * 10);
-			for (i = 0 ; i < count ; i++) {
-				other = *chess;
-				moonfish_play(&other, moves + i);
-				if (moonfish_validate(&other)) return 0;
-			}
-		}
-	}
-	
-	return 1;
+	struct moonfish_move moves[256];
+	return moonfish_legal_moves(chess, moves) == 0;
 }
 
 int moonfish_move(struct moonfish_chess *chess, struct moonfish_move *found, int from, int to)
@@ -381,7 +775,7 @@ static char moonfish_to_file(int i)
 	return "abcdefgh"[i];
 }
 
-int moonfish_from_fen(struct moonfish_chess *chess, char *fen)
+static int moonfish_fen(struct moonfish_chess *chess, char *fen)
 {
 	int x, y;
 	int type, color;
@@ -399,6 +793,7 @@ int moonfish_from_fen(struct moonfish_chess *chess, char *fen)
 	chess->ooo[0] = 0;
 	chess->ooo[1] = 0;
 	chess->passing = 0;
+	chess->clock = 0;
 	
 	x = 0;
 	y = 0;
@@ -481,9 +876,27 @@ int moonfish_from_fen(struct moonfish_chess *chess, char *fen)
 		chess->passing = (x + 1) + (y + 2) * 10;
 	}
 	
+	/* (note: the fullmove number is ignored) */
+	
+	if (*fen == 0) return 0;
+	if (*fen++ != ' ') return 1;
+	
+	while (*fen >= '0' && *fen <= '9') {
+		if (chess->clock < 1000) chess->clock = chess->clock * 10 + *fen - '0';
+		fen++;
+	}
+	
 	return 0;
 }
 
+int moonfish_from_fen(struct moonfish_chess *chess, char *fen)
+{
+	int error;
+	error = moonfish_fen(chess, fen);
+	moonfish_recompute(chess);
+	return error;
+}
+
 int moonfish_checkmate(struct moonfish_chess *chess)
 {
 	if (!moonfish_check(chess)) return 0;
@@ -493,52 +906,41 @@ int moonfish_checkmate(struct moonfish_chess *chess)
 static int moonfish_match_move(struct moonfish_chess *chess, struct moonfish_move *move, int type, int promotion, int x0, int y0, int x1, int y1, int check, int captured)
 {
 	int found;
-	int x, y;
-	struct moonfish_move moves[32];
-	int xi0, yi0, xi1, yi1;
+	struct moonfish_move moves[256];
 	int i, count;
 	struct moonfish_chess other;
 	
-	xi0 = 0, xi1 = 8;
-	yi0 = 0, yi1 = 8;
-	
-	if (x0) xi0 = x0 - 1, xi1 = x0;
-	if (y0) yi0 = y0 - 1, yi1 = y0;
-	
 	found = 0;
 	
-	for (y = yi0 ; y < yi1 ; y++) {
+	count = moonfish_all_moves(chess, moves, 256);
+	for (i = 0 ; i < count ; i++) {
 		
-		for (x = xi0 ; x < xi1 ; x++) {
-			
-			count = moonfish_moves(chess, moves, (x + 1) + (y + 2) * 10);
-			for (i = 0 ; i < count ; i++) {
-				
-				if (chess->board[moves[i].from] % 16 != type) continue;
-				if (promotion && promotion != moves[i].piece % 16) continue;
-				if (moves[i].to % 10 != x1) continue;
-				if (moves[i].to / 10 - 1 != y1) continue;
-				
-				if (captured) {
-					if (chess->board[moves[i].from] % 16 == moonfish_pawn) {
-						if (moves[i].from % 10 == moves[i].to % 10) continue;
-					}
-					else {
-						if (chess->board[moves[i].to] == moonfish_empty) continue;
-					}
-				}
-				
-				other = *chess;
-				moonfish_play(&other, moves + i);
-				if (!moonfish_validate(&other)) continue;
-				if (check && !moonfish_check(&other)) continue;
-				if (check == 2 && !moonfish_checkmate(&other)) continue;
-				if (found) return 1;
-				found = 1;
-				*move = moves[i];
+		if (x0 && moves[i].from % 10 != x0) continue;
+		if (y0 && moves[i].from / 10 - 1 != y0) continue;
+		if (chess->board[moves[i].from] % 16 != type) continue;
+		if (promotion && promotion != moves[i].piece % 16) continue;
+		if (moves[i].to % 10 != x1) continue;
+		if (moves[i].to / 10 - 1 != y1) continue;
+		
+		if (captured) {
+			if (chess->board[moves[i].from] % 16 == moonfish_pawn) {
+				if (moves[i].from % 10 == moves[i].to % 10) continue;
+			}
+			else {
+				if (chess->board[moves[i].to] == moonfish_empty) continue;
 			}
 		}
+		
+		other = *chess;
+		moonfish_play(&other, moves + i);
+		if (!moonfish_validate(&other)) continue;
+		if (check && !moonfish_check(&other)) continue;
+		if (check == 2 && !moonfish_checkmate(&other)) continue;
+		if (found) return 1;
+		found = 1;
+		*move = moves[i];
 	}
+	
 	if (!found) return 1;
 	return 0;
 }
@@ -749,8 +1151,7 @@ void moonfish_to_san(struct moonfish_chess *chess, struct moonfish_move *move, c
 {
 	static char names[] = "NBRQK";
 	
-	int x, y;
-	struct moonfish_move moves[32];
+	struct moonfish_move moves[256];
 	char file_ambiguity, rank_ambiguity, ambiguity;
 	int to_x, to_y;
 	int from_x, from_y;
@@ -798,24 +1199,19 @@ void moonfish_to_san(struct moonfish_chess *chess, struct moonfish_move *move, c
 	rank_ambiguity = 0;
 	ambiguity = 0;
 	
-	for (y = 0 ; y < 8 ; y++) {
+	count = moonfish_all_moves(chess, moves, 256);
+	
+	for (i = 0 ; i < count ; i++) {
 		
-		for (x = 0 ; x < 8 ; x++) {
-			
-			if ((x + 1) + (y + 2) * 10 == move->from) continue;
-			count = moonfish_moves(chess, moves, (x + 1) + (y + 2) * 10);
-			
-			for (i = 0 ; i < count ; i++) {
-				
-				if (moves[i].to != move->to) continue;
-				if (chess->board[moves[i].from] != chess->board[move->from]) continue;
-				
-				ambiguity = 1;
-				if (moves[i].from % 10 - 1 == from_x) file_ambiguity = 1;
-				if (moves[i].from / 10 - 2 == from_y) rank_ambiguity = 1;
-			}
-		}
+		if (moves[i].from == move->from) continue;
+		if (moves[i].to != move->to) continue;
+		if (chess->board[moves[i].from] != chess->board[move->from]) continue;
+		
+		ambiguity = 1;
+		if (moves[i].from % 10 - 1 == from_x) file_ambiguity = 1;
+		if (moves[i].from / 10 - 2 == from_y) rank_ambiguity = 1;
 	}
+	
 	*name++ = names[(chess->board[move->from] & 0xF) - 2];
 	
 	if (ambiguity) {
@@ -848,3 +1244,76 @@ void moonfish_to_san(struct moonfish_chess *chess, struct moonfish_move *move, c
 }
 
 #endif
+
+#ifdef moonfish_debug
+
+/* computes the piece-square sums from scratch (to check the ones kept by "moonfish_play") */
+static int moonfish_full_score(struct moonfish_chess *chess)
+{
+	int x, y;
+	int x1, y1;
+	int type, color, piece;
+	int score0, score1;
+	int i;
+	int phase;
+	
+	score0 = 16;
+	score1 = 8;
+	phase = 0;
+	
+	for (y = 0 ; y < 8 ; y++) {
+		
+		for (x = 0 ; x < 8 ; x++) {
+			
+			piece = chess->board[(x + 1) + (y + 2) * 10];
+			if (piece == moonfish_empty) continue;
+			type = piece % 16 - 1;
+			color = piece / 16 - 1;
+			
+			x1 = x;
+			y1 = y;
+			
+			if (x1 > 3) x1 = 7 - x1;
+			if (color == 1) y1 = 7 - y1;
+			
+			i = x1 + y1 * 4 + type * 32;
+			
+			score0 += moonfish_values0[i] * ((color ^ chess->white) * 2 - 1);
+			score1 += moonfish_values1[i] * ((color ^ chess->white) * 2 - 1);
+			phase += moonfish_phases[type];
+		}
+	}
+	
+	return (score0 * phase + score1 * (24 - phase)) / 24;
+}
+
+#endif
+
+int moonfish_score(struct moonfish_chess *chess)
+{
+	int score0, score1, phase;
+	int score;
+	
+	/* (the phase is never negative, so it doesn't borrow from the endgame lane, but the endgame lane might borrow from the middlegame lane) */
+	phase = chess->score & 0xFFFF;
+	score1 = moonfish_lane(chess->score >> 16);
+	score0 = moonfish_lane((chess->score - ((moonfish_bitboard) score1 << 16)) >> 32);
+	
+	if (!chess->white) {
+		score0 = -score0;
+		score1 = -score1;
+	}
+	
+	score0 += 16;
+	score1 += 8;
+	score = (score0 * phase + score1 * (24 - phase)) / 24;
+	
+#ifdef moonfish_debug
+	if (score != moonfish_full_score(chess)) {
+		fprintf(stderr, "incremental evaluation mismatch\n");
+		exit(1);
+	}
+#endif
+	
+	return score;
+}
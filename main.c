@@ -21,6 +21,7 @@ struct moonfish_option {
 struct moonfish_info {
 	struct moonfish_root *root;
 	_Atomic unsigned char searching;
+	unsigned char debug;
 #ifndef moonfish_no_threads
 	unsigned char has_thread;
 	thrd_t thread;
@@ -28,6 +29,8 @@ struct moonfish_info {
 	struct moonfish_option *options;
 	struct moonfish_result result;
 	struct moonfish_options search_options;
+	/* the name of the network file currently loaded (or an empty string) */
+	char eval_file[2048];
 };
 
 static int moonfish_getoption(struct moonfish_option *options, char *name)
@@ -42,6 +45,7 @@ static int moonfish_getoption(struct moonfish_option *options, char *name)
 static void moonfish_log_result(struct moonfish_result *result)
 {
 	printf("info depth %.0f nodes %ld time %ld", floor(log(result->node_count) / log(16)), result->node_count, result->time);
+	if (result->hashfull >= 0) printf(" hashfull %d", result->hashfull);
 }
 
 static void moonfish_log(struct moonfish_result *result0, void *data)
@@ -83,6 +87,43 @@ static void moonfish_log(struct moonfish_result *result0, void *data)
 	}
 }
 
+static void moonfish_log_debug(struct moonfish_info *info)
+{
+	struct moonfish_memory memory;
+	
+	moonfish_memory(info->root, &memory);
+	printf("info string memory nodes %ld bytes %ld chunks %ld allocations %ld collections %ld\n", memory.node_count, memory.byte_count, memory.chunk_count, memory.allocation_count, memory.collection_count);
+	printf("info string contention retries %ld waits %ld\n", info->result.retry_count, info->result.wait_count);
+}
+
+#ifdef moonfish_statistics
+
+static void moonfish_log_stats(struct moonfish_info *info)
+{
+	struct moonfish_stats stats;
+	int i, j, count;
+	
+	count = moonfish_stats(info->root, &stats, -1);
+	
+	printf("info string stats expansions %ld children %ld bytes %ld retries %ld waits %ld\n", stats.expansion_count, stats.child_count, stats.byte_count, stats.retry_count, stats.wait_count);
+	
+	printf("info string stats depths");
+	for (j = 0 ; j < 32 ; j++) {
+		if (stats.depths[j] != 0) printf(" %d:%ld", j, stats.depths[j]);
+	}
+	printf("\n");
+	
+	for (i = -1 ; i < count ; i++) {
+		moonfish_stats(info->root, &stats, i);
+		if (i >= 0 && stats.expansion_count == 0) continue;
+		printf("info string stats");
+		if (i >= 0) printf(" thread %d", i + 1);
+		printf(" time select %.0f expand %.0f score %.0f propagate %.0f\n", stats.select_time / 1e6, stats.expand_time / 1e6, stats.score_time / 1e6, stats.propagate_time / 1e6);
+	}
+}
+
+#endif
+
 static moonfish_result_t moonfish_go0(void *data)
 {
 	static struct moonfish_chess chess;
@@ -102,6 +143,11 @@ static moonfish_result_t moonfish_go0(void *data)
 	moonfish_best_move(info->root, &info->result, &info->search_options);
 	moonfish_to_uci(&chess, &info->result.move, name);
 	
+	if (info->debug) moonfish_log_debug(info);
+#ifdef moonfish_statistics
+	if (info->debug) moonfish_log_stats(info);
+#endif
+	
 	moonfish_log_result(&info->result);
 	printf(" score cp %d\n", info->result.score);
 	printf("bestmove %s\n", name);
@@ -222,6 +268,12 @@ static void moonfish_go(struct moonfish_info *info)
 	info->search_options.our_time = our_time;
 	info->search_options.thread_count = moonfish_getoption(info->options, "Threads");
 	info->search_options.node_count = node_count;
+	info->search_options.max_memory = moonfish_getoption(info->options, "Hash");
+	info->search_options.transpositions = moonfish_getoption(info->options, "Transpositions");
+	info->search_options.batch = moonfish_getoption(info->options, "BatchSize");
+#ifndef moonfish_no_threads
+	info->search_options.virtual_loss = moonfish_getoption(info->options, "VirtualLoss");
+#endif
 	
 	if (depth >= 0 && depth < 6) {
 		node_count = pow(16, depth);
@@ -253,8 +305,10 @@ static void moonfish_position(struct moonfish_root *root)
 	static struct moonfish_chess chess, chess0;
 	static struct moonfish_move move;
 	static char line[2048];
+	static moonfish_bitboard hashes[1024];
 	
 	char *arg;
+	int count;
 	
 	arg = strtok(NULL, "\r\n\t ");
 	if (arg == NULL) {
@@ -290,6 +344,7 @@ static void moonfish_position(struct moonfish_root *root)
 	}
 	
 	arg = strtok(NULL, "\r\n\t ");
+	count = 0;
 	
 	if (arg != NULL && !strcmp(arg, "moves")) {
 		
@@ -302,6 +357,13 @@ static void moonfish_position(struct moonfish_root *root)
 				exit(1);
 			}
 			
+			/* (the oldest positions are dropped to make room, since they are the least likely to be repeated) */
+			if (count == (int) (sizeof hashes / sizeof *hashes)) {
+				count--;
+				memmove(hashes, hashes + 1, count * sizeof *hashes);
+			}
+			hashes[count++] = chess.hash;
+			
 			moonfish_root(root, &chess0);
 			if (moonfish_equal(&chess0, &chess)) {
 				moonfish_play(&chess, &move);
@@ -310,11 +372,117 @@ static void moonfish_position(struct moonfish_root *root)
 			else {
 				moonfish_play(&chess, &move);
 			}
+			
+			/* positions from before a capture or pawn move can't be repeated after it */
+			if (chess.clock == 0) count = 0;
 		}
 	}
 	
 	moonfish_root(root, &chess0);
 	if (!moonfish_equal(&chess0, &chess)) moonfish_reroot(root, &chess);
+	
+	/* (so that the search knows about repetitions with positions from before the root) */
+	moonfish_history(root, hashes, count);
+}
+
+/* searches a fixed set of positions with a fixed number of nodes each, then shows the total time taken */
+/* the signature only depends on the moves and scores found, so it changes only when the search itself changes */
+/* (note: with more than one thread, the search is not deterministic, so neither is the signature) */
+static void moonfish_bench(struct moonfish_info *info, char *node_arg, char *thread_arg)
+{
+	static char *positions[] = {
+		"position fen rnbqkbnr/pppppppp/8/8/8/8/PPPPPPPP/RNBQKBNR w KQkq - 0 1",
+		"position fen r3k2r/p1ppqpb1/bn2pnp1/3PN3/1p2P3/2N2Q1p/PPPBBPPP/R3K2R w KQkq - 0 1",
+		"position fen 8/2p5/3p4/KP5r/1R3p1k/8/4P1P1/8 w - - 0 1",
+		"position fen r3k2r/Pppp1ppp/1b3nbN/nP6/BBP1P3/q4N2/Pp1P2PP/R2Q1RK1 w kq - 0 1",
+		"position fen rnbq1k1r/pp1Pbppp/2p5/8/2B5/8/PPP1NnPP/RNBQK2R w KQ - 1 8",
+		"position fen r4rk1/1pp1qppp/p1np1n2/2b1p1B1/2B1P1b1/P1NP1N2/1PP1QPPP/R4RK1 w - - 0 10",
+		"position fen r1bqkb1r/pppp1ppp/2n2n2/4p3/2B1P3/5N2/PPPP1PPP/RNBQK2R w KQkq - 4 4",
+		"position fen 4rrk1/pp1n3p/3q2pQ/2p1pb2/2PP4/2P3N1/P2B2PP/4RRK1 b - - 7 19",
+		"position fen 8/8/4k3/3p4/3P4/4K3/8/8 w - - 0 1",
+		"position fen 6k1/6p1/6Pp/ppp5/3pn2P/1P3K2/1PP2P2/3N4 b - - 0 1",
+		"position startpos moves e2e4 e7e5 g1f3 b8c6 f1c4 g8f6 f3g1 f6g8 g1f3 g8f6",
+	};
+	
+	static struct moonfish_chess chess;
+	static struct moonfish_result result;
+	static struct moonfish_options options;
+	static char line[256];
+	
+	struct moonfish_root *root;
+	long int node_count, thread_count, time, total_node_count;
+	unsigned long int signature;
+	char *end, name[6];
+	int i;
+	
+	node_count = 100000;
+	if (node_arg != NULL) {
+		errno = 0;
+		node_count = strtol(node_arg, &end, 10);
+		if (errno || *end != 0 || node_count < 1) {
+			fprintf(stderr, "malformed node count in 'bench' command\n");
+			exit(1);
+		}
+	}
+	
+	thread_count = 1;
+	if (thread_arg != NULL) {
+		errno = 0;
+		thread_count = strtol(thread_arg, &end, 10);
+		if (errno || *end != 0 || thread_count < 1 || thread_count > 0xFFFF) {
+			fprintf(stderr, "malformed thread count in 'bench' command\n");
+			exit(1);
+		}
+	}
+	
+	options.max_time = -1;
+	options.our_time = -1;
+	options.node_count = node_count;
+	options.thread_count = thread_count;
+	options.max_memory = moonfish_getoption(info->options, "Hash");
+	options.transpositions = moonfish_getoption(info->options, "Transpositions");
+	options.batch = moonfish_getoption(info->options, "BatchSize");
+	options.virtual_loss = 0;
+#ifndef moonfish_no_threads
+	options.virtual_loss = moonfish_getoption(info->options, "VirtualLoss");
+#endif
+	
+	/* a separate state is used, so that the position (and search tree) set up before is kept */
+	/* (its searches also don't show logs, since it has no "idle/log" handler) */
+	root = moonfish_new();
+	if (info->eval_file[0] != 0 && moonfish_network(root, info->eval_file)) {
+		printf("info string could not load evaluation file '%s' for the benchmark\n", info->eval_file);
+		moonfish_finish(root);
+		return;
+	}
+	
+	time = 0;
+	total_node_count = 0;
+	signature = 0;
+	
+	for (i = 0 ; i < (int) (sizeof positions / sizeof *positions) ; i++) {
+		
+		/* (the positions are given like in "position" commands, so that some of them can have moves played before them, which might be repeated) */
+		strcpy(line, positions[i]);
+		strtok(line, "\r\n\t ");
+		moonfish_position(root);
+		moonfish_root(root, &chess);
+		
+		moonfish_best_move(root, &result, &options);
+		moonfish_to_uci(&chess, &result.move, name);
+		
+		printf("info string bench position %d bestmove %s score cp %d nodes %ld time %ld\n", i + 1, name, result.score, result.node_count, result.time);
+		fflush(stdout);
+		
+		time += result.time;
+		total_node_count += result.node_count;
+		signature = (signature * 31 + result.move.from * 128 + result.move.to) & 0xFFFFFFFF;
+		signature = (signature * 31 + (unsigned int) result.score) & 0xFFFFFFFF;
+	}
+	
+	moonfish_finish(root);
+	
+	printf("info string bench nodes %ld time %ld nps %.0f signature %08lX\n", total_node_count, time, total_node_count * 1000.0 / (time > 0 ? time : 1), signature);
 }
 
 static int moonfish_compare_name(char *a, char *b)
@@ -333,6 +501,7 @@ static void moonfish_setoption(struct moonfish_info *info)
 	char *arg, *end;
 	long int value;
 	int i;
+	int error;
 	
 	arg = strtok(NULL, "\r\n\t ");
 	if (arg == NULL || strcmp(arg, "name")) {
@@ -361,12 +530,41 @@ static void moonfish_setoption(struct moonfish_info *info)
 		exit(1);
 	}
 	
+	if (!strcmp(info->options[i].name, "EvalFile")) {
+		
+		/* the file name may contain spaces, so the rest of the line is used */
+		arg = strtok(NULL, "\r\n");
+		if (arg == NULL || !strcmp(arg, "<empty>")) arg = "";
+		
+		if (info->searching) {
+			printf("info string cannot load evaluation file while searching\n");
+			return;
+		}
+		
+		/* (the previous evaluation is kept when the file can't be loaded) */
+		error = moonfish_network(info->root, arg);
+		if (error == 0) strcpy(info->eval_file, arg);
+		if (error == 1) printf("info string could not read evaluation file '%s': %s\n", arg, strerror(errno));
+		if (error == 2) printf("info string evaluation file '%s' has the wrong size\n", arg);
+		
+		return;
+	}
+	
 	arg = strtok(NULL, "\r\n\t ");
 	if (arg == NULL) {
 		fprintf(stderr, "missing value\n");
 		exit(1);
 	}
 	
+	if (!strcmp(info->options[i].type, "check")) {
+		if (strcmp(arg, "true") && strcmp(arg, "false")) {
+			fprintf(stderr, "malformed option value\n");
+			exit(1);
+		}
+		info->options[i].value = !strcmp(arg, "true");
+		return;
+	}
+	
 	errno = 0;
 	value = strtol(arg, &end, 10);
 	if (errno || *end != 0 || value < info->options[i].min || value > info->options[i].max) {
@@ -384,27 +582,39 @@ int main(int argc, char **argv)
 	static struct moonfish_option options[] = {
 #ifndef moonfish_no_threads
 		{"Threads", "spin", 1, 1, 0xFFFF},
+		{"VirtualLoss", "spin", 1, 0, 0xFF},
 #endif
 		{"MultiPV", "spin", 1, 0, 256},
+		{"Hash", "spin", 256, 0, 0xFFFFF},
+		{"Transpositions", "check", 0, 0, 1},
+		{"BatchSize", "spin", 1, 1, 256},
+		{"EvalFile", "string", 0, 0, 0},
 		{NULL, NULL, 0, 0, 0},
 	};
 	
 	char *arg;
 	int i;
 	
-	if (argc > 1) {
-		fprintf(stderr, "usage: %s (no arguments)\n", argv[0]);
+	if (argc > 1 && (strcmp(argv[1], "bench") || argc > 4)) {
+		fprintf(stderr, "usage: %s [bench [<nodes> [<threads>]]]\n", argv[0]);
 		return 1;
 	}
 	
 	info.root = moonfish_new();
 	info.searching = 0;
+	info.debug = 0;
 	info.options = options;
 	
 #ifndef moonfish_no_threads
 	info.has_thread = 0;
 #endif
 	
+	if (argc > 1) {
+		moonfish_bench(&info, argc > 2 ? argv[2] : NULL, argc > 3 ? argv[3] : NULL);
+		moonfish_finish(info.root);
+		return 0;
+	}
+	
 	moonfish_idle(info.root, &moonfish_log, &info);
 	
 	for (;;) {
@@ -444,6 +654,14 @@ int main(int argc, char **argv)
 			printf("id name moonfish " moonfish_version "\n");
 			printf("id author zamfofex\n");
 			for (i = 0 ; options[i].name != NULL ; i++) {
+				if (!strcmp(options[i].type, "check")) {
+					printf("option name %s type check default %s\n", options[i].name, options[i].value ? "true" : "false");
+					continue;
+				}
+				if (!strcmp(options[i].type, "string")) {
+					printf("option name %s type string default <empty>\n", options[i].name);
+					continue;
+				}
 				printf("option name %s type %s default %d min %d max %d\n", options[i].name, options[i].type, options[i].value, options[i].min, options[i].max);
 			}
 			printf("uciok\n");
@@ -455,6 +673,29 @@ int main(int argc, char **argv)
 			continue;
 		}
 		
+		if (!strcmp(arg, "bench")) {
+			if (info.searching) {
+				fprintf(stderr, "cannot start benchmark while searching\n");
+				exit(1);
+			}
+			arg = strtok(NULL, "\r\n\t ");
+			moonfish_bench(&info, arg, arg == NULL ? NULL : strtok(NULL, "\r\n\t "));
+			continue;
+		}
+		
+		if (!strcmp(arg, "stats")) {
+			if (info.searching) {
+				fprintf(stderr, "cannot show statistics while searching\n");
+				exit(1);
+			}
+#ifdef moonfish_statistics
+			moonfish_log_stats(&info);
+#else
+			printf("info string statistics are not available (compile with '-Dmoonfish_statistics' for them)\n");
+#endif
+			continue;
+		}
+		
 		if (!strcmp(arg, "setoption")) {
 			moonfish_setoption(&info);
 			if (info.searching) printf("info string warning: option might only take effect next search request\n");
@@ -477,7 +718,17 @@ int main(int argc, char **argv)
 		
 #endif
 		
-		if (!strcmp(arg, "debug") || !strcmp(arg, "ucinewgame") || !strcmp(arg, "stop")) continue;
+		if (!strcmp(arg, "debug")) {
+			arg = strtok(NULL, "\r\n\t ");
+			if (arg == NULL || (strcmp(arg, "on") && strcmp(arg, "off"))) {
+				fprintf(stderr, "malformed 'debug' command\n");
+				exit(1);
+			}
+			info.debug = !strcmp(arg, "on");
+			continue;
+		}
+		
+		if (!strcmp(arg, "ucinewgame") || !strcmp(arg, "stop")) continue;
 		
 		fprintf(stderr, "warning: unknown command '%s'\n", arg);
 	}
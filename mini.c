@@ -25,6 +25,8 @@ int main(void)
 	moonfish_root(root, &chess);
 	options.thread_count = sysconf(_SC_NPROCESSORS_ONLN);
 	if (options.thread_count < 1) options.thread_count = 1;
+	options.max_memory = 256;
+	options.virtual_loss = 1;
 	
 	for (;;) {
 		
@@ -33,6 +33,11 @@
 
 /* the board is not just an 8 x 8 array because of an optimisation that is performed when generating moves */
 
+/* alongside the 10 x 12 board, positions also carry bitboards (64-bit integers with one bit per square) */
+/* the bit with index "x + y * 8" represents the square at file "x" and rank "y" */
+/* these are kept in sync with the board by "moonfish_play" (so it's not possible to modify the board directly) */
+/* (note: "long long" is not part of C89, so the compiler must support it as an extension) */
+
 /* ~ ~ ~ ~ ~ */
 
 /* white pieces */
@@ -63,12 +68,24 @@
 #define moonfish_empty 0
 #define moonfish_outside 0xFF
 
+/* a set of squares (see above) */
+/* (also used for other values that need 64 bits, like hashes) */
+#ifdef __GNUC__
+__extension__ typedef unsigned long long int moonfish_bitboard;
+#else
+typedef unsigned long long int moonfish_bitboard;
+#endif
+
 /* represents a chess position */
 struct moonfish_chess {
 	
 	/* 10 x 12 array board representation */
 	unsigned char board[120];
 	
+	/* bitboards for each piece type of each color, indexed by "[piece / 16 - 1][piece % 16]" */
+	/* (the bitboard at index zero for each color contains all pieces of that color) */
+	moonfish_bitboard bitboards[2][7];
+	
 	/* flags representing castling rights */
 	unsigned char oo[2], ooo[2];
 	
@@ -80,6 +97,18 @@ struct moonfish_chess {
 	/* 1 means white's turn */
 	/* 0 means black's turn */
 	unsigned char white;
+	
+	/* halfmove clock (plies since the last capture or pawn move, for the fifty-move rule) */
+	/* note: this is not part of the hash, and it is ignored by "moonfish_equal" */
+	int clock;
+	
+	/* Zobrist hash of the position (kept in sync by "moonfish_play", like the bitboards) */
+	/* equal positions always have the same hash, different positions very likely have different hashes */
+	moonfish_bitboard hash;
+	
+	/* piece-square sums for the middlegame and for the endgame (positive means good for white), and the game phase */
+	/* these are packed into a single integer, and also kept in sync by "moonfish_play" (see "moonfish_score") */
+	moonfish_bitboard score;
 };
 
 /* represents a move that may be made on a given position */
@@ -102,6 +131,14 @@ struct moonfish_options {
 	long int our_time;
 	long int node_count;
 	int thread_count;
+	/* maximum memory for the search tree in MiB (zero means no limit) */
+	long int max_memory;
+	/* how many losses each visit still in progress counts as (so that threads spread out, zero means none) */
+	int virtual_loss;
+	/* whether positions reached through different sequences of moves share their children (a boolean) */
+	int transpositions;
+	/* how many leaves each thread selects before expanding them all at once (zero means one) */
+	int batch;
 };
 
 /* represents a search result */
@@ -110,8 +147,47 @@ struct moonfish_result {
 	long int node_count;
 	long int time;
 	int score;
+	/* permille of the maximum memory in use (or -1 when there is no limit) */
+	int hashfull;
+	/* how many times threads had to back off from a node being expanded by another thread (and start over) */
+	long int retry_count;
+	/* how many times threads had to yield because the whole root was being expanded by other threads */
+	long int wait_count;
 };
 
+/* represents statistics about the memory used for the search tree */
+struct moonfish_memory {
+	/* nodes currently allocated (including discarded ones that weren't reclaimed yet) */
+	long int node_count;
+	/* bytes currently allocated for nodes (in chunks) */
+	long int byte_count;
+	/* chunks currently allocated */
+	long int chunk_count;
+	/* children arrays allocated so far (one per expanded node) */
+	long int allocation_count;
+	/* how many times the tree was moved into fresh chunks (reclaiming discarded nodes) */
+	long int collection_count;
+};
+
+#ifdef moonfish_statistics
+
+/* represents statistics about where the search spent its time (for a single search) */
+/* note: these are only kept when compiled with "moonfish_statistics" (since measuring them makes the search slower) */
+struct moonfish_stats {
+	/* how many leaves were selected at each depth (the last one also counts deeper leaves) */
+	long int depths[32];
+	/* nodes expanded, and children generated for them */
+	long int expansion_count, child_count;
+	/* bytes allocated for children */
+	long int byte_count;
+	/* see "moonfish_result" */
+	long int retry_count, wait_count;
+	/* nanoseconds spent selecting leaves, expanding them (except for scoring their children), scoring children, and propagating scores */
+	double select_time, expand_time, score_time, propagate_time;
+};
+
+#endif
+
 #ifndef moonfish_mini
 
 /* initialises the position and sets up the initial position */
@@ -127,6 +203,18 @@ void moonfish_chess(struct moonfish_chess *chess);
 /* this will return the number of moves generated */
 int moonfish_moves(struct moonfish_chess *chess, struct moonfish_move *moves, int from);
 
+/* similar to "moonfish_moves", but generates moves for all pieces of the player whose turn it is */
+/* at most "max" moves will be stored in "moves" (an array of moves of size 256 is always enough) */
+/* this will return the number of moves generated */
+int moonfish_all_moves(struct moonfish_chess *chess, struct moonfish_move *moves, int max);
+
+/* given a chess position, generates all valid moves for the player whose turn it is */
+/* unlike "moonfish_moves", this will never generate a move that leaves the king in check */
+/* the moves are stored in "moves", so it must be able to fit all of them */
+/* note: an array of moves of size 256 is always enough (no position has more valid moves than that) */
+/* this will return the number of moves generated (zero means checkmate or stalemate) */
+int moonfish_legal_moves(struct moonfish_chess *chess, struct moonfish_move *moves);
+
 /* tries to find the best move in the given position with the given options */
 /* the move found is the best for the player whose turn it is on the given position */
 void moonfish_best_move(struct moonfish_root *root, struct moonfish_result *result, struct moonfish_options *options);
@@ -185,12 +273,17 @@ void moonfish_play(struct moonfish_chess *chess, struct moonfish_move *move);
 /* note: 0 means false (i.e. not finished) */
 int moonfish_finished(struct moonfish_chess *chess);
 
+/* returns a static evaluation of the position in centipawns (from the perspective of the player whose turn it is) */
+/* (this is constant time, since it only interpolates the sums kept by "moonfish_play" according to the game phase) */
+int moonfish_score(struct moonfish_chess *chess);
+
 /* returns whether the game ended due to checkmate */
 /* note: 0 means false (i.e. no checkmate) */
 int moonfish_checkmate(struct moonfish_chess *chess);
 
 /* returns whether two positions are equal */
 /* note: 0 means false (i.e. the positions are different) */
+/* note: positions with different hashes are rejected without comparing their boards */
 int moonfish_equal(struct moonfish_chess *a, struct moonfish_chess *b);
 
 /* sets the state's position */
@@ -199,6 +292,15 @@ void moonfish_reroot(struct moonfish_root *root, struct moonfish_chess *chess);
 /* gets the state's position (it is stored in the given position pointer) */
 void moonfish_root(struct moonfish_root *root, struct moonfish_chess *chess);
 
+/* sets the hashes of the positions played before the state's position (the most recent one last) */
+/* these are used to detect repetitions during search (note: "moonfish_reroot" clears them) */
+void moonfish_history(struct moonfish_root *root, moonfish_bitboard *hashes, int count);
+
+/* loads a neural network from the given file to evaluate positions during search (instead of the piece-square tables) */
+/* an empty file name goes back to using the piece-square tables (note: the state's search tree is cleared either way) */
+/* note: 0 means success, 1 means the file could not be read (with "errno" set), 2 means it has the wrong size (either way, the evaluation is left unchanged) */
+int moonfish_network(struct moonfish_root *root, char *name);
+
 /* creates a new state (with the initial position) */
 struct moonfish_root *moonfish_new(void);
 
@@ -212,6 +314,17 @@ void moonfish_unstop(struct moonfish_root *root);
 /* requests the PV with the given index, with at most 'count' moves */
 void moonfish_pv(struct moonfish_root *root, struct moonfish_move *moves, struct moonfish_result *result, int index, int *count);
 
+/* gets statistics about the memory used by the given state (stored in the given pointer) */
+void moonfish_memory(struct moonfish_root *root, struct moonfish_memory *memory);
+
+#ifdef moonfish_statistics
+
+/* gets the statistics for the last search of the thread with the given index (or of all threads together when the index is negative) */
+/* this will return the number of threads */
+int moonfish_stats(struct moonfish_root *root, struct moonfish_stats *stats, int index);
+
+#endif
+
 /* adds an "idle/log" handler, which will be called every once in a while during search */
 void moonfish_idle(struct moonfish_root *root, void (*log)(struct moonfish_result *result, void *data), void *data);
 
@@ -7,7 +7,11 @@ set -eo pipefail
 
 go()
 {
-	echo "position fen $1"
+	for option in "${@:3}"
+	do
+		echo "setoption name $option"
+	done
+	echo "position $1"
 	echo "go depth $2"
 	while read -r line
 	do
@@ -22,11 +26,33 @@ show()
 {
 	echo "- - - POSITION $2 - - -" >&2
 	./perft -F "$3" "$1"
-	coproc go "$3" "$1"
+	coproc go "fen $3" "$1"
+	{ ./moonfish | tee /dev/fd/3 3> /dev/fd/3 | tail -2 | sed -E 's/ time [^ ]+//g' ; } <&"${COPROC[0]}" 3>&"${COPROC[1]}"
+	echo >&2
+}
+
+# searches with transpositions enabled, from positions where an earlier position can be repeated through different move orders
+repeat()
+{
+	echo "- - - REPETITION $2 - - -" >&2
+	coproc go "$3" "$1" "Transpositions value true"
 	{ ./moonfish | tee /dev/fd/3 3> /dev/fd/3 | tail -2 | sed -E 's/ time [^ ]+//g' ; } <&"${COPROC[0]}" 3>&"${COPROC[1]}"
 	echo >&2
 }
 
+# searches using the network from 'network.sh' instead of the PSTs
+evaluate()
+{
+	echo "- - - NETWORK $2 - - -" >&2
+	coproc go "fen $3" "$1" "EvalFile value $network"
+	{ ./moonfish | tee /dev/fd/3 3> /dev/fd/3 | tail -2 | sed -E 's/ time [^ ]+//g' ; } <&"${COPROC[0]}" 3>&"${COPROC[1]}"
+	echo >&2
+}
+
+network="$(mktemp)"
+trap 'rm -f "$network"' EXIT
+scripts/network.sh > "$network"
+
 for n in 0 1 2 3 4
 do
 	echo "= = = DEPTH $n = = =" >&2
@@ -38,5 +64,10 @@ do
 	show "$n" 4.2 'r2q1rk1/pP1p2pp/Q4n2/bbp1p3/Np6/1B3NBn/pPPP1PPP/R3K2R b KQ - 0 1'
 	show "$n" 5 'rnbq1k1r/pp1Pbppp/2p5/8/2B5/8/PPP1NnPP/RNBQK2R w KQ - 1 8'
 	show "$n" 6 'r4rk1/1pp1qppp/p1np1n2/2b1p1B1/2B1P1b1/P1NP1N2/1PP1QPPP/R4RK1 w - - 0 10'
+	repeat "$n" 1 'startpos moves g1f3 g8f6 b1c3 b8c6'
+	repeat "$n" 2 'startpos moves e2e4 e7e5 g1f3 b8c6 f1c4 g8f6 f3g1 f6g8 g1f3 g8f6'
+	evaluate "$n" 1 'rnbqkbnr/pppppppp/8/8/8/8/PPPPPPPP/RNBQKBNR w KQkq - 0 1'
+	evaluate "$n" 2 'r3k2r/p1ppqpb1/bn2pnp1/3PN3/1p2P3/2N2Q1p/PPPBBPPP/R3K2R w KQkq -'
+	evaluate "$n" 6 'r4rk1/1pp1qppp/p1np1n2/2b1p1B1/2B1P1b1/P1NP1N2/1PP1QPPP/R4RK1 w - - 0 10'
 	echo >&2
 done | tee /dev/stderr | diff scripts/check.txt -
@@ -0,0 +1,87 @@
+#!/usr/bin/env bash
+
+# moonfish's license: 0BSD
+# copyright 2025 zamfofex
+
+# writes a small network (usable with the 'EvalFile' UCI option) to stdout
+# (it is not trained, it just counts material with a few positional terms, so that the network evaluation can be tested deterministically)
+
+set -eo pipefail
+
+# hidden neurons (for the perspective of each player):
+# - 0 to 4: the player's own pawns, knights, bishops, rooks, queens (each weighted so that it can't go over 255)
+# - 5 to 9: the opponent's pawns, knights, bishops, rooks, queens
+# - 10: how far the player's own pawns have advanced
+# - 11: how close the player's own knights and bishops are to the center
+size=12
+
+# the input weights for each piece type (pawns, knights, bishops, rooks, queens)
+inputs=(31 100 100 100 200)
+
+# the output weights for each piece type (which are "value / 2 * 255 * 255 * 64 / 400 / input", since the material is counted by both players' neurons)
+outputs=(16780 15606 16646 26010 23409)
+
+values=()
+
+for side in 0 1
+do
+	for type in 0 1 2 3 4 5
+	do
+		for square in {0..63}
+		do
+			x=$((square % 8))
+			y=$((square / 8))
+			row=()
+			for ((i = 0 ; i < size ; i++))
+			do
+				row[i]=0
+			done
+			if [ "$type" -lt 5 ]
+			then
+				row[side * 5 + type]=${inputs[type]}
+			fi
+			if [ "$side" = 0 ] && [ "$type" = 0 ] && [ "$y" -gt 0 ] && [ "$y" -lt 7 ]
+			then
+				row[10]=$(((y - 1) * 4))
+			fi
+			if [ "$side" = 0 ] && { [ "$type" = 1 ] || [ "$type" = 2 ] ; }
+			then
+				dx=$((x < 4 ? 3 - x : x - 4))
+				dy=$((y < 4 ? 3 - y : y - 4))
+				row[11]=$((8 - 2 * (dx > dy ? dx : dy)))
+			fi
+			values+=("${row[@]}")
+		done
+	done
+done
+
+# hidden biases
+for ((i = 0 ; i < size ; i++))
+do
+	values+=(0)
+done
+
+# output weights for the player to move, then for the other player
+for sign in 1 -1
+do
+	for type in 0 1 2 3 4
+	do
+		values+=($((sign * outputs[type])))
+	done
+	for type in 0 1 2 3 4
+	do
+		values+=($((-sign * outputs[type])))
+	done
+	values+=($((sign * 13005)) $((sign * 26010)))
+done
+
+# output bias
+values+=(0)
+
+bytes=()
+for value in "${values[@]}"
+do
+	bytes+=($((value & 255)) $((value >> 8 & 255)))
+done
+
+printf "$(printf '\\x%02x' "${bytes[@]}")"
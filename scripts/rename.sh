@@ -9,7 +9,7 @@ alphabet=({a..z} {a..z}{a..z} {a..z}{a..z}{a..z})
 alphabet2=("${alphabet[@]}")
 declare -A names
 
-functions="main fopen fread printf fprintf sscanf fgets fflush stdin stdout stderr strcmp strncmp strcpy strtok strstr strchr malloc realloc free exit errno clock_gettime timespec tv_sec tv_nsec typedef memmove fabs sqrt log pow qsort thrd_t atomic_compare_exchange_strong atomic_fetch_add thrd_create thrd_success thrd_join sysconf"
+functions="main fopen fread printf fprintf sscanf fgets fflush stdin stdout stderr strcmp strncmp strcpy strtok strstr strchr malloc calloc realloc free exit errno clock_gettime timespec tv_sec tv_nsec typedef memmove fabs sqrt log pow qsort thrd_t atomic_compare_exchange_strong atomic_fetch_add thrd_create thrd_success thrd_join thrd_sleep thrd_yield mtx_t mtx_plain mtx_init mtx_lock mtx_unlock cnd_t cnd_init cnd_wait cnd_broadcast sysconf"
 keywords="do while for if else switch case break continue return extern static struct enum unsigned signed long short int char double float void const sizeof $functions"
 
 while read -r name
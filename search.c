@@ -4,6 +4,7 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <errno.h>
 #include <limits.h>
 #include <math.h>
 
@@ -13,6 +14,10 @@
 #include <time.h>
 #endif
 
+#if defined(__SSE2__) && !defined(moonfish_mini)
+#include <emmintrin.h>
+#endif
+
 #include "moonfish.h"
 #include "threads.h"
 
@@ -23,6 +28,19 @@ static long int moonfish_clock(void)
 	return GetTickCount();
 }
 
+#ifdef moonfish_statistics
+
+/* a finer clock than "moonfish_clock", to measure how long each part of the search takes */
+static double moonfish_nanoseconds(void)
+{
+	LARGE_INTEGER count, frequency;
+	QueryPerformanceCounter(&count);
+	QueryPerformanceFrequency(&frequency);
+	return count.QuadPart * 1e9 / frequency.QuadPart;
+}
+
+#endif
+
 #else
 
 #ifdef moonfish_no_clock
@@ -37,6 +55,16 @@ static long int moonfish_clock(void)
 	return t * 1000;
 }
 
+#ifdef moonfish_statistics
+
+/* (without "clock_gettime", times are only measured in whole seconds, so the statistics are very rough) */
+static double moonfish_nanoseconds(void)
+{
+	return moonfish_clock() * 1e6;
+}
+
+#endif
+
 #else
 
 static long int moonfish_clock(void)
@@ -49,87 +77,278 @@ static long int moonfish_clock(void)
 	return ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
 }
 
+#ifdef moonfish_statistics
+
+/* a finer clock than "moonfish_clock", to measure how long each part of the search takes */
+static double moonfish_nanoseconds(void)
+{
+	struct timespec ts;
+	if (clock_gettime(CLOCK_MONOTONIC, &ts)) {
+		perror("clock_gettime");
+		exit(1);
+	}
+	return ts.tv_sec * 1e9 + ts.tv_nsec;
+}
+
+#endif
+
 #endif
 
 #endif
 
+/* nodes don't point to their parent, since transpositions might share their children with other nodes */
+/* (so the path taken from the root is kept by each worker instead, see "moonfish_path") */
 struct moonfish_node {
-	struct moonfish_node *parent;
 	struct moonfish_node *children;
 	_Atomic int visits, count;
-	_Atomic short int score;
+	/* visits in progress by other threads (which haven't been propagated yet) */
+	_Atomic int pending;
+	/* (note: this is an "int" so that it can be swapped atomically, but it always fits in a "short") */
+	_Atomic int score;
 	_Atomic unsigned char bounds[2];
 	_Atomic unsigned char ignored;
-	unsigned char from, index;
+	/* whether the children are shared with a transposition */
+	_Atomic unsigned char shared;
+	struct moonfish_move move;
+};
+
+/* positions of expanded nodes, so that their children may be shared with transpositions */
+/* "state" is 0 for free entries, 1 for entries being filled in, and 2 for entries that are ready */
+struct moonfish_entry {
+	moonfish_bitboard hash;
+	struct moonfish_node *node;
+	_Atomic int state;
+};
+
+/* children arrays are allocated from chunks of nodes */
+struct moonfish_chunk {
+	struct moonfish_chunk *next;
+	struct moonfish_node nodes[4096];
+};
+
+/* a path from the root to a leaf (with the hashes of the positions along it, and the position of the leaf) */
+struct moonfish_path {
+	struct moonfish_node **nodes;
+	moonfish_bitboard *hashes;
+	int depth, max_depth;
+	struct moonfish_chess chess;
+	/* the leaf's score before it was expanded */
+	int score;
+	/* whether the leaf is drawn through this path, even though it might not be through others (see "moonfish_select") */
+	int drawn;
+#ifndef moonfish_mini
+	/* accumulators of the network for each position along the path, plus one more for the leaf's children (see "moonfish_network") */
+	/* (and the last one is used as scratch space when checking them in debug builds) */
+	short int *accumulators;
+	int accumulator_count;
+#endif
+};
+
+#ifndef moonfish_mini
+
+/* a small quantised neural network that may be used to evaluate positions instead of "moonfish_score" */
+/* each player has its own hidden layer of "size" neurons (its "accumulator"), with an input for each kind of piece on each square from that player's perspective */
+/* (the output only depends on the two accumulators, which can be updated incrementally after each move, since only a few inputs change) */
+struct moonfish_network {
+	int size;
+	/* "768 * size" input weights (grouped by input), "size" hidden biases, then "2 * size" output weights (for the player to move first) */
+	short int *weights, *biases, *output;
+	int bias;
+};
+
+#endif
+
+/* each thread allocates nodes from its own arena (which only releases its chunks all at once) */
+struct moonfish_arena {
+	struct moonfish_chunk *chunks;
+	int used;
+	long int node_count, allocation_count, chunk_count;
+};
+
+struct moonfish_worker {
+	struct moonfish_root *root;
+	struct moonfish_arena arena;
+	/* paths to the leaves of the current batch (see "moonfish_iterate") */
+	struct moonfish_path *paths;
+	int path_count;
+#ifndef moonfish_no_threads
+	thrd_t thread;
+	int index, generation;
+	long int retry_count, wait_count;
+#endif
+#ifdef moonfish_statistics
+	struct moonfish_stats stats;
+#endif
 };
 
 struct moonfish_root {
 	struct moonfish_node node;
 	struct moonfish_chess chess;
+	/* hashes of the positions played before the root's position (the most recent one last) */
+	moonfish_bitboard history[256];
+	int history_count;
+	struct moonfish_worker **workers;
+	int worker_count;
+	long int garbage;
+	long int collection_count;
+	long int node_count, max_chunks;
+	int virtual_loss;
+	int batch;
+	/* (null when transpositions are not shared) */
+	struct moonfish_entry *entries;
+	long int entry_count;
+	_Atomic int chunk_count;
+	_Atomic int halt;
+#ifndef moonfish_no_threads
+	/* the workers wait on "condition" for a new search (with a different "generation") */
+	/* "running" counts the workers still searching, and "parked" counts those waiting for "pause" to be cleared */
+	mtx_t mutex;
+	cnd_t condition;
+	int generation, active, running, parked, quit;
+	_Atomic int pause;
+#endif
 #ifndef moonfish_mini
 	_Atomic int stop;
 	void (*log)(struct moonfish_result *result, void *data);
 	void *data;
+	/* (null when positions are evaluated with "moonfish_score") */
+	struct moonfish_network *network;
+	/* accumulators for the root's position */
+	short int *accumulator;
 #endif
 };
 
-static short int moonfish_score(struct moonfish_chess *chess)
+static struct moonfish_node *moonfish_allocate(struct moonfish_worker *worker, int count)
+{
+	struct moonfish_arena *arena;
+	struct moonfish_chunk *chunk;
+	
+	arena = &worker->arena;
+	if (arena->chunks == NULL || arena->used + count > (int) (sizeof chunk->nodes / sizeof *chunk->nodes)) {
+		chunk = malloc(sizeof *chunk);
+		if (chunk == NULL) {
+			perror("malloc");
+			exit(1);
+		}
+		chunk->next = arena->chunks;
+		arena->chunks = chunk;
+		arena->used = 0;
+		arena->chunk_count++;
+#ifdef moonfish_no_threads
+		worker->root->chunk_count++;
+#else
+		atomic_fetch_add(&worker->root->chunk_count, 1);
+#endif
+	}
+	
+	arena->used += count;
+	arena->node_count += count;
+	arena->allocation_count++;
+	
+#ifdef moonfish_statistics
+	worker->stats.byte_count += count * (long int) sizeof *chunk->nodes;
+#endif
+	
+	return arena->chunks->nodes + arena->used - count;
+}
+
+static void moonfish_release(struct moonfish_chunk *chunk)
+{
+	struct moonfish_chunk *next;
+	while (chunk != NULL) {
+		next = chunk->next;
+		free(chunk);
+		chunk = next;
+	}
+}
+
+/* note: the memory of discarded nodes is only reclaimed by "moonfish_collect" */
+/* (children shared with a transposition are left alone, since they might still be reachable through it) */
+static long int moonfish_discard(struct moonfish_node *node)
 {
-	static short int values0[] = {0, 0, 0, 0, 56, 96, 84, 65, 61, 92, 74, 79, 58, 88, 83, 95, 69, 102, 96, 115, 82, 132, 156, 159, 258, 226, 262, 274, 0, 0, 0, 0, 262, 317, 317, 310, 323, 314, 337, 344, 321, 350, 356, 367, 341, 370, 371, 371, 366, 368, 406, 398, 361, 399, 433, 442, 338, 329, 420, 402, 194, 295, 237, 363, 356, 375, 360, 346, 382, 394, 396, 378, 386, 393, 387, 395, 382, 390, 392, 414, 380, 397, 421, 430, 406, 429, 426, 440, 374, 391, 413, 395, 343, 339, 291, 298, 456, 467, 469, 477, 427, 460, 462, 465, 440, 462, 447, 458, 447, 457, 454, 469, 474, 484, 496, 513, 491, 529, 533, 548, 523, 521, 552, 552, 564, 550, 535, 552, 1046, 1032, 1038, 1058, 1046, 1062, 1070, 1058, 1049, 1063, 1056, 1052, 1047, 1056, 1051, 1046, 1073, 1053, 1058, 1057, 1078, 1083, 1077, 1071, 1049, 1001, 1063, 1041, 1057, 1071, 1089, 1107, 20, 37, -21, -15, 18, 4, -61, -82, -63, -50, -84, -97, -93, -68, -82, -97, -77, -40, -24, -40, -31, 28, 52, 36, 44, 13, 53, 63, 163, 141, 61, 70};
-	static short int values1[] = {0, 0, 0, 0, 137, 142, 141, 145, 132, 137, 127, 134, 139, 138, 123, 119, 156, 152, 134, 125, 223, 214, 184, 178, 255, 269, 236, 215, 0, 0, 0, 0, 320, 318, 360, 369, 345, 378, 378, 387, 360, 388, 396, 416, 384, 403, 428, 436, 388, 413, 430, 439, 376, 396, 414, 416, 362, 399, 385, 408, 317, 372, 415, 387, 389, 391, 391, 410, 393, 402, 404, 420, 402, 416, 431, 431, 410, 429, 436, 437, 420, 437, 431, 440, 412, 421, 431, 425, 399, 420, 418, 423, 409, 418, 423, 430, 699, 708, 715, 717, 706, 704, 709, 708, 705, 712, 718, 716, 724, 732, 737, 734, 737, 740, 743, 738, 744, 738, 742, 734, 742, 749, 743, 746, 727, 736, 744, 738, 1255, 1256, 1247, 1234, 1248, 1249, 1246, 1271, 1276, 1274, 1307, 1305, 1308, 1332, 1342, 1359, 1309, 1358, 1374, 1384, 1318, 1333, 1375, 1386, 1327, 1388, 1381, 1410, 1338, 1346, 1357, 1352, -71, -42, -29, -42, -27, -11, 12, 17, -3, 12, 30, 39, 8, 30, 45, 55, 21, 48, 49, 52, 29, 49, 42, 30, -7, 42, 27, 10, -95, -30, -17, -26};
-	static int values[] = {0, 1, 1, 2, 4, 0};
+	long int count;
+	int i;
+	
+	count = 0;
+	if (!node->shared) {
+		for (i = 0 ; i < node->count ; i++) count += moonfish_discard(node->children + i) + 1;
+	}
+	node->count = 0;
+	node->shared = 0;
 	
-	int x, y;
-	int x1, y1;
-	int type, color, piece;
-	int score0, score1;
+	return count;
+}
+
+/* the old nodes are marked with a count of -2 and point to their copy (so that children shared between transpositions are only copied once) */
+static void moonfish_copy(struct moonfish_worker *worker, struct moonfish_node *node)
+{
+	struct moonfish_node *children;
 	int i;
-	int phase;
 	
-	score0 = 16;
-	score1 = 8;
-	phase = 0;
+	if (node->count <= 0) return;
 	
-	for (y = 0 ; y < 8 ; y++) {
-		
-		for (x = 0 ; x < 8 ; x++) {
-			
-			piece = chess->board[(x + 1) + (y + 2) * 10];
-			if (piece == moonfish_empty) continue;
-			type = piece % 16 - 1;
-			color = piece / 16 - 1;
-			
-			x1 = x;
-			y1 = y;
-			
-			if (x1 > 3) x1 = 7 - x1;
-			if (color == 1) y1 = 7 - y1;
-			
-			i = x1 + y1 * 4 + type * 32;
-			
-			score0 += values0[i] * ((color ^ chess->white) * 2 - 1);
-			score1 += values1[i] * ((color ^ chess->white) * 2 - 1);
-			phase += values[type];
-		}
+	children = node->children;
+	if (children->count == -2) {
+		node->children = children->children;
+		return;
+	}
+	
+	node->children = moonfish_allocate(worker, node->count);
+	
+	for (i = 0 ; i < node->count ; i++) {
+		node->children[i] = children[i];
+		children[i].count = -2;
+		children[i].children = node->children + i;
 	}
 	
-	return (score0 * phase + score1 * (24 - phase)) / 24;
+	for (i = 0 ; i < node->count ; i++) moonfish_copy(worker, node->children + i);
 }
 
-static void moonfish_discard(struct moonfish_node *node)
+/* moves the whole tree into fresh chunks, then releases all of the old chunks at once */
+static void moonfish_collect(struct moonfish_root *root)
 {
+	struct moonfish_chunk *chunks, *chunk;
+	struct moonfish_arena *arena;
 	int i;
-	for (i = 0 ; i < node->count ; i++) moonfish_discard(node->children + i);
-	if (node->count > 0) free(node->children);
-	node->count = 0;
+	
+	chunks = NULL;
+	
+	for (i = 0 ; i < root->worker_count ; i++) {
+		arena = &root->workers[i]->arena;
+		while (arena->chunks != NULL) {
+			chunk = arena->chunks;
+			arena->chunks = chunk->next;
+			chunk->next = chunks;
+			chunks = chunk;
+		}
+		arena->used = 0;
+		arena->node_count = 0;
+		arena->chunk_count = 0;
+	}
+	
+	root->chunk_count = 0;
+	if (root->worker_count > 0) moonfish_copy(root->workers[0], &root->node);
+	
+	/* entries follow their nodes to the fresh chunks (and entries for nodes that weren't copied are dropped) */
+	for (i = 0 ; i < root->entry_count ; i++) {
+		if (root->entries[i].state == 0) continue;
+		if (root->entries[i].node->count == -2) root->entries[i].node = root->entries[i].node->children;
+		else root->entries[i].state = 0;
+	}
+	
+	moonfish_release(chunks);
+	
+	root->garbage = 0;
+	root->collection_count++;
 }
 
 static void moonfish_node(struct moonfish_node *node)
 {
-	node->parent = NULL;
 	node->count = 0;
 	node->visits = 0;
+	node->pending = 0;
 	node->ignored = 0;
+	node->shared = 0;
 	node->bounds[0] = 0;
 	node->bounds[1] = 1;
 }
@@ -143,308 +362,1161 @@ static int moonfish_compare(const void *ax, const void *bx)
 	if (!a->ignored && b->ignored) return -1;
 	if (a->ignored && !b->ignored) return 1;
 	if (a->score != b->score) return a->score - b->score;
-	if (a->from != b->from) return a->from - b->from;
-	if (a->index != b->index) return a->index - b->index;
+	if (a->move.from != b->move.from) return a->move.from - b->move.from;
+	if (a->move.to != b->move.to) return a->move.to - b->move.to;
+	if (a->move.piece != b->move.piece) return b->move.piece - a->move.piece;
 	return 0;
 }
 
-static void moonfish_expand(struct moonfish_node *node, struct moonfish_chess *chess)
+#ifndef moonfish_mini
+
+/* adds the given weights to the given accumulator */
+/* (with SSE2, eight at a time, which also doesn't rely on the compiler knowing that they don't overlap) */
+static void moonfish_add(short int *accumulator, short int *weights, int size)
 {
-	int x, y;
-	int count, i;
-	int child_count;
-	struct moonfish_move moves[32];
-	struct moonfish_chess other;
+	int i;
 	
-	node->children = NULL;
-	child_count = 0;
+	i = 0;
 	
-	for (y = 0 ; y < 8 ; y++) {
-		
-		for (x = 0 ; x < 8 ; x++) {
-			
-			count = moonfish_moves(chess, moves, (x + 1) + (y + 2) * 10);
-			if (count == 0) continue;
-			
-			node->children = realloc(node->children, (child_count + count) * sizeof *node->children);
-			if (node->children == NULL) {
-				perror("realloc");
-				exit(1);
-			}
-			
-			for (i = 0 ; i < count ; i++) {
-				
-				other = *chess;
-				moonfish_play(&other, moves + i);
-				
-				if (!moonfish_validate(&other)) continue;
-				moonfish_node(node->children + child_count);
-				node->children[child_count].parent = node;
-				node->children[child_count].from = (x + 1) + (y + 2) * 10;
-				node->children[child_count].index = i;
-				
-				node->children[child_count].score = moonfish_score(&other);
-				
-				child_count++;
-			}
-		}
+#ifdef __SSE2__
+	for (; i + 8 <= size ; i += 8) {
+		_mm_storeu_si128((__m128i *) (accumulator + i), _mm_add_epi16(_mm_loadu_si128((__m128i *) (accumulator + i)), _mm_loadu_si128((__m128i *) (weights + i))));
 	}
+#endif
 	
-	if (child_count == 0 && node->children != NULL) free(node->children);
-	if (child_count > 0) qsort(node->children, child_count, sizeof *node, &moonfish_compare);
-	
-	node->count = child_count;
-}
-
-static double moonfish_confidence(struct moonfish_node *node)
-{
-	if (node->visits == 0) return 1e9;
-	return 1 / (1 + pow(10, node->score / 400.0)) + 2 * sqrt(log(node->parent->visits) / node->visits);
+	for (; i < size ; i++) accumulator[i] += weights[i];
 }
 
-static void moonfish_node_move(struct moonfish_node *node, struct moonfish_chess *chess, struct moonfish_move *move)
+/* subtracts the given weights from the given accumulator */
+static void moonfish_subtract(short int *accumulator, short int *weights, int size)
 {
-	struct moonfish_move moves[32];
-	moonfish_moves(chess, moves, node->from);
-	*move = moves[node->index];
+	int i;
+	
+	i = 0;
+	
+#ifdef __SSE2__
+	for (; i + 8 <= size ; i += 8) {
+		_mm_storeu_si128((__m128i *) (accumulator + i), _mm_sub_epi16(_mm_loadu_si128((__m128i *) (accumulator + i)), _mm_loadu_si128((__m128i *) (weights + i))));
+	}
+#endif
+	
+	for (; i < size ; i++) accumulator[i] -= weights[i];
 }
 
-static void moonfish_node_chess(struct moonfish_node *node, struct moonfish_chess *chess)
+/* adds (or subtracts) the weights of the input for a piece on a square to the accumulators of both players (white's first) */
+static void moonfish_feature(struct moonfish_network *network, short int *accumulator, int color, int type, int square, int sign)
 {
-	struct moonfish_move move;
-	moonfish_node_move(node, chess, &move);
-	moonfish_play(chess, &move);
+	short int *white, *black;
+	
+	white = network->weights + (long int) ((color == 0 ? 0 : 384) + (type - 1) * 64 + square) * network->size;
+	black = network->weights + (long int) ((color == 1 ? 0 : 384) + (type - 1) * 64 + (square ^ 56)) * network->size;
+	
+	if (sign > 0) {
+		moonfish_add(accumulator, white, network->size);
+		moonfish_add(accumulator + network->size, black, network->size);
+	}
+	else {
+		moonfish_subtract(accumulator, white, network->size);
+		moonfish_subtract(accumulator + network->size, black, network->size);
+	}
 }
 
-static struct moonfish_node *moonfish_select(struct moonfish_node *node, struct moonfish_chess *chess)
+/* computes the accumulators for the given position from scratch */
+static void moonfish_refresh(struct moonfish_network *network, short int *accumulator, struct moonfish_chess *chess)
 {
-	struct moonfish_node *next;
-	double max_confidence, confidence;
-	int i, count;
+	int color, type, square;
 	
-	for (;;) {
-		
-#ifdef moonfish_no_threads
-		count = node->count;
-		if (count == 0) return node;
-#else
-		for (;;) {
-			count = 0;
-			if (atomic_compare_exchange_strong(&node->count, &count, -1)) return node;
-			if (count > 0) break;
-		}
-#endif
-		
-		max_confidence = -1;
-		
-		while (max_confidence < 0) {
-			for (i = 0 ; i < count ; i++) {
-				if (node->children[i].ignored) continue;
-				if (node->children[i].count == -1) continue;
-				confidence = moonfish_confidence(node->children + i);
-				if (confidence > max_confidence) {
-					next = node->children + i;
-					max_confidence = confidence;
-				}
+	memcpy(accumulator, network->biases, network->size * sizeof *accumulator);
+	memcpy(accumulator + network->size, network->biases, network->size * sizeof *accumulator);
+	
+	for (color = 0 ; color < 2 ; color++) {
+		for (type = 1 ; type < 7 ; type++) {
+			for (square = 0 ; square < 64 ; square++) {
+				if (chess->bitboards[color][type] >> square & 1) moonfish_feature(network, accumulator, color, type, square, 1);
 			}
 		}
-		
-		node = next;
-		moonfish_node_chess(node, chess);
 	}
 }
 
-static void moonfish_propagate(struct moonfish_node *node)
+/* computes the accumulators for the position "after" from the ones for the position "before" (only updating the inputs that changed) */
+static void moonfish_update(struct moonfish_network *network, short int *accumulator, short int *previous, struct moonfish_chess *before, struct moonfish_chess *after)
 {
-	int i;
-	short int score, child_score;
+	int color, type, square;
+	moonfish_bitboard changed;
 	
-	while (node != NULL) {
-		score = node->count == 0 ? 0 : SHRT_MIN;
-		for (i = 0 ; i < node->count ; i++) {
-			child_score = -node->children[i].score;
-			if (score < child_score) score = child_score;
+	memcpy(accumulator, previous, network->size * 2 * sizeof *accumulator);
+	
+	for (color = 0 ; color < 2 ; color++) {
+		for (type = 1 ; type < 7 ; type++) {
+			changed = before->bitboards[color][type] ^ after->bitboards[color][type];
+			for (square = 0 ; changed != 0 ; square++) {
+				if (changed & 1) moonfish_feature(network, accumulator, color, type, square, (after->bitboards[color][type] >> square & 1) ? 1 : -1);
+				changed >>= 1;
+			}
 		}
-		node->score = score;
-#ifdef moonfish_no_threads
-		node->visits++;
-#else
-		atomic_fetch_add(&node->visits, 1);
-#endif
-		node = node->parent;
 	}
 }
 
-static void moonfish_propagate_bounds(struct moonfish_node *node)
+/* computes the sum of the products of the clamped hidden values with their output weights */
+static long int moonfish_dot(short int *values, short int *weights, int size)
 {
-	int i, j;
-	int bound;
+	long int sum;
+	int i, value;
+#ifdef __SSE2__
+	__m128i zero, max, total;
+	int j, lanes[4];
+#endif
 	
-	i = 1;
-	while (node != NULL) {
-		bound = 0;
-		for (j = 0 ; j < node->count ; j++) {
-			if (1 - node->children[j].bounds[1 - i] > bound) {
-				bound = 1 - node->children[j].bounds[1 - i];
-			}
-		}
-		for (j = 0 ; j < node->count ; j++) {
-			if (1 - node->children[j].bounds[1 - i] < bound) {
-				node->children[j].ignored = 1;
-			}
+	sum = 0;
+	i = 0;
+	
+#ifdef __SSE2__
+	
+	zero = _mm_setzero_si128();
+	max = _mm_set1_epi16(255);
+	
+	/* (each lane adds at most 64 pairs of products before they are moved to "sum", so it never overflows) */
+	while (i + 8 <= size) {
+		total = _mm_setzero_si128();
+		for (j = 0 ; j < 512 && i + 8 <= size ; j += 8) {
+			total = _mm_add_epi32(total, _mm_madd_epi16(_mm_min_epi16(_mm_max_epi16(_mm_loadu_si128((__m128i *) (values + i)), zero), max), _mm_loadu_si128((__m128i *) (weights + i))));
+			i += 8;
 		}
-		node->bounds[i] = bound;
-		node = node->parent;
-		i = 1 - i;
+		_mm_storeu_si128((__m128i *) lanes, total);
+		sum += (long int) lanes[0] + lanes[1] + lanes[2] + lanes[3];
+	}
+	
+#endif
+	
+	for (; i < size ; i++) {
+		value = values[i];
+		if (value < 0) value = 0;
+		if (value > 255) value = 255;
+		sum += value * weights[i];
 	}
+	
+	return sum;
 }
 
-static moonfish_result_t moonfish_search(void *data)
+/* computes the output of the network (in centipawns, from the perspective of the given player) */
+/* (the hidden layer is clamped between 0 and 255, the output weights are scaled by 64, and the output itself is scaled by 400) */
+static int moonfish_output(struct moonfish_network *network, short int *accumulator, int white)
 {
-	struct moonfish_root *root;
-	struct moonfish_node *leaf;
-	struct moonfish_chess chess;
-	int i;
+	short int *ours, *theirs;
+	long int sum;
 	
-	root = data;
+	ours = accumulator + (white ? 0 : network->size);
+	theirs = accumulator + (white ? network->size : 0);
 	
-	for (i = 0 ; i < 1024 ; i++) {
-		chess = root->chess;
-		leaf = moonfish_select(&root->node, &chess);
-		moonfish_expand(leaf, &chess);
-		if (leaf->count == 0 && moonfish_check(&chess)) moonfish_propagate_bounds(leaf);
-		moonfish_propagate(leaf);
-	}
+	sum = moonfish_dot(ours, network->output, network->size);
+	sum += moonfish_dot(theirs, network->output + network->size, network->size);
 	
-	return moonfish_value;
+	sum = (sum / 255 + network->bias) * 400 / (255 * 64);
+	if (sum > 30000) return 30000;
+	if (sum < -30000) return -30000;
+	return sum;
 }
 
-#ifndef moonfish_no_threads
-
-static void moonfish_start(struct moonfish_root *root, int thread_count)
+/* computes the accumulators for the last node of the path (from the ones of the node before it, whose position is "before") */
+/* (or copies the root's ones when "before" is null) */
+static void moonfish_accumulate(struct moonfish_root *root, struct moonfish_path *path, struct moonfish_chess *before)
 {
-	thrd_t *threads;
-	int i;
-	
-	threads = malloc(thread_count * sizeof *threads);
-	if (threads == NULL) {
-		perror("malloc");
-		exit(1);
-	}
+	short int *accumulator;
+	int size;
 	
-	for (i = 0 ; i < thread_count ; i++) {
-		if (thrd_create(&threads[i], &moonfish_search, root) != thrd_success) {
-			fprintf(stderr, "could not create thread\n");
-			exit(1);
-		}
-	}
+	size = root->network->size * 2;
 	
-	for (i = 0 ; i < thread_count ; i++) {
-		if (thrd_join(threads[i], NULL) != thrd_success) {
-			fprintf(stderr, "could not join thread\n");
+	if (path->accumulator_count < path->max_depth + 2) {
+		path->accumulator_count = path->max_depth + 2;
+		path->accumulators = realloc(path->accumulators, path->accumulator_count * (long int) size * sizeof *path->accumulators);
+		if (path->accumulators == NULL) {
+			perror("realloc");
 			exit(1);
 		}
 	}
 	
-	free(threads);
+	accumulator = path->accumulators + (path->depth - 1) * (long int) size;
+	if (before == NULL) memcpy(accumulator, root->accumulator, size * sizeof *accumulator);
+	else moonfish_update(root->network, accumulator, accumulator - size, before, &path->chess);
 }
 
 #endif
 
-static void moonfish_clean(struct moonfish_node *node)
+/* evaluates a position reached by playing a move on the leaf of the path (from the perspective of its player to move) */
+static int moonfish_evaluate(struct moonfish_root *root, struct moonfish_path *path, struct moonfish_chess *chess)
 {
-	int i;
-	for (i = 0 ; i < node->count ; i++) {
-		if (node->children[i].visits < node->visits / node->count / 2) {
-			moonfish_discard(node->children + i);
+#ifndef moonfish_mini
+	short int *accumulator;
+	int score;
+#ifdef moonfish_debug
+	short int *other;
+#endif
+	
+	if (root->network != NULL) {
+		
+		accumulator = path->accumulators + path->depth * (long int) root->network->size * 2;
+		moonfish_update(root->network, accumulator, accumulator - root->network->size * 2, &path->chess, chess);
+		score = moonfish_output(root->network, accumulator, chess->white);
+		
+#ifdef moonfish_debug
+		other = path->accumulators + (path->accumulator_count - 1) * (long int) root->network->size * 2;
+		moonfish_refresh(root->network, other, chess);
+		if (memcmp(accumulator, other, root->network->size * 2 * sizeof *other)) {
+			fprintf(stderr, "incremental accumulator mismatch\n");
+			exit(1);
 		}
-		moonfish_clean(node->children + i);
+#endif
+		
+		return score;
 	}
+#endif
+	
+	return moonfish_score(chess);
 }
 
-void moonfish_best_move(struct moonfish_root *root, struct moonfish_result *result, struct moonfish_options *options)
+/* each position may be stored in any of the eight entries following the one its hash points to */
+static void moonfish_insert(struct moonfish_root *root, struct moonfish_node *node, struct moonfish_chess *chess)
 {
-	struct moonfish_node *node;
-	long int time, time0;
-	long int node_count;
-	int i, j;
-	int count;
-	
-	time = LONG_MAX;
-	if (options->our_time >= 0) time = options->our_time / 16;
-	if (options->max_time >= 0 && time > options->max_time) time = options->max_time;
-	time -= time / 32 + 125;
-	if (time < 0) time = 0;
-	
-	time0 = moonfish_clock();
-	node_count = options->node_count;
-	if (node_count < 0) node_count = LONG_MAX;
+	struct moonfish_entry *entry;
+	int i;
+#ifndef moonfish_no_threads
+	int state;
+#endif
 	
-	for (;;) {
+	for (i = 0 ; i < 8 ; i++) {
+		entry = root->entries + ((chess->hash + i) & (root->entry_count - 1));
 #ifdef moonfish_no_threads
-		moonfish_search(root);
+		if (entry->state != 0) continue;
 #else
-		moonfish_start(root, options->thread_count);
-#endif
-		moonfish_clean(&root->node);
-		if (root->node.count > 0) qsort(root->node.children, root->node.count, sizeof root->node, &moonfish_compare);
-		for (i = 0 ; i < root->node.count ; i++) {
-			node = root->node.children + i;
-			for (j = 0 ; j < node->count ; j++) node->children[j].parent = node;
-		}
-		moonfish_node_move(root->node.children, &root->chess, &result->move);
-		result->score = root->node.score;
-		result->node_count = root->node.visits;
-		result->time = moonfish_clock() - time0;
-#ifndef moonfish_mini
-		if (root->log != NULL) (*root->log)(result, root->data);
-		if (root->stop) break;
-		if (root->node.visits >= node_count) break;
+		state = 0;
+		if (!atomic_compare_exchange_strong(&entry->state, &state, 1)) continue;
 #endif
-		if (result->time >= time) break;
-		count = root->node.count;
-		for (i = 0 ; i < root->node.count ; i++) {
-			if (root->node.children[i].ignored) count--;
-		}
-		if (count <= 1) break;
+		entry->hash = chess->hash;
+		entry->node = node;
+		entry->state = 2;
+		return;
 	}
 }
 
-void moonfish_reroot(struct moonfish_root *root, struct moonfish_chess *chess)
+/* tries to share the children of an expanded node for the same position (returns whether it was possible) */
+static int moonfish_transpose(struct moonfish_root *root, struct moonfish_node *node, struct moonfish_chess *chess)
 {
-	static struct moonfish_chess chess0;
-	
-	struct moonfish_node *children;
+	struct moonfish_entry *entry;
+	struct moonfish_node *other;
 	int i, j;
+	int count, score;
 	
-	children = root->node.children;
-	
-	for (i = 0 ; i < root->node.count ; i++) {
-		chess0 = root->chess;
-		moonfish_node_chess(&children[i], &chess0);
-		if (moonfish_equal(&chess0, chess)) break;
+	for (i = 0 ; i < 8 ; i++) {
+		
+		entry = root->entries + ((chess->hash + i) & (root->entry_count - 1));
+		if (entry->state != 2 || entry->hash != chess->hash) continue;
+		
+		other = entry->node;
+		count = other->count;
+		if (count <= 0) continue;
+		
+		score = SHRT_MIN;
+		for (j = 0 ; j < count ; j++) {
+			if (score < -other->children[j].score) score = -other->children[j].score;
+		}
+		
+		other->shared = 1;
+		node->shared = 1;
+		node->children = other->children;
+		node->bounds[0] = other->bounds[0];
+		node->bounds[1] = other->bounds[1];
+		node->score = score;
+		node->count = count;
+		return 1;
 	}
 	
-	root->chess = *chess;
+	return 0;
+}
+
+static void moonfish_expand(struct moonfish_worker *worker, struct moonfish_path *path)
+{
+	int count, i;
+	int score;
+	int shared;
+	struct moonfish_move moves[256];
+	struct moonfish_chess other;
+	struct moonfish_node *node;
+	struct moonfish_chess *chess;
+#ifdef moonfish_statistics
+	double time;
+#endif
 	
-	if (i >= root->node.count) {
-		moonfish_discard(&root->node);
-		moonfish_node(&root->node);
+	node = path->nodes[path->depth - 1];
+	chess = &path->chess;
+	
+	shared = worker->root->entries != NULL && node != &worker->root->node;
+	if (shared && moonfish_transpose(worker->root, node, chess)) return;
+	
+	count = moonfish_legal_moves(chess, moves);
+	if (count == 0) {
+		node->score = 0;
+		node->count = 0;
 		return;
 	}
 	
-	for (j = 0 ; j < root->node.count ; j++) {
-		if (i == j) continue;
-		moonfish_discard(children + j);
-	}
+	node->children = moonfish_allocate(worker, count);
 	
-	root->node = children[i];
-	root->node.parent = NULL;
-	free(children);
+#ifdef moonfish_statistics
+	worker->stats.expansion_count++;
+	worker->stats.child_count += count;
+	time = moonfish_nanoseconds();
+#endif
+	
+	/* note: the node's own score is set before its children are published (so no other thread can be updating it yet) */
+	score = SHRT_MIN;
+	
+	for (i = 0 ; i < count ; i++) {
+		
+		other = *chess;
+		moonfish_play(&other, moves + i);
+		
+		moonfish_node(node->children + i);
+		node->children[i].move = moves[i];
+		
+		node->children[i].score = moonfish_evaluate(worker->root, path, &other);
+		if (score < -node->children[i].score) score = -node->children[i].score;
+	}
+	
+#ifdef moonfish_statistics
+	worker->stats.score_time += moonfish_nanoseconds() - time;
+#endif
+	
+	qsort(node->children, count, sizeof *node, &moonfish_compare);
+	
+	node->score = score;
+	node->count = count;
+	
+	if (shared) moonfish_insert(worker->root, node, chess);
+}
+
+/* the expected score for each possible node score (indexed by "score - SHRT_MIN") */
+static double moonfish_winrates[USHRT_MAX + 1];
+
+static void moonfish_winrate(void)
+{
+	static int done = 0;
+	long int i;
+	
+	if (done) return;
+	
+	for (i = 0 ; i <= USHRT_MAX ; i++) moonfish_winrates[i] = 1 / (1 + pow(10, (i + SHRT_MIN) / 400.0));
+	done = 1;
+}
+
+/* visits in progress count as losses (weighted by "virtual_loss") so that threads searching at the same time diverge */
+/* (note: "log_visits" is the logarithm of the parent's visits, computed once for all of its children) */
+/* (computing it for a few children at a time with SIMD doesn't help, since selection is limited by loading the children rather than by this) */
+static double moonfish_confidence(struct moonfish_node *node, double log_visits, int virtual_loss)
+{
+	double pending, visits;
+	
+	pending = (double) node->pending * virtual_loss;
+	if (node->visits == 0) return 1e9 / (1 + pending);
+	
+	visits = node->visits + pending;
+	return node->visits / visits * moonfish_winrates[node->score - SHRT_MIN] + 2 * sqrt(log_visits / visits);
+}
+
+static void moonfish_node_chess(struct moonfish_node *node, struct moonfish_chess *chess)
+{
+	moonfish_play(chess, &node->move);
+}
+
+static void moonfish_push(struct moonfish_path *path, struct moonfish_node *node)
+{
+	if (path->depth >= path->max_depth) {
+		path->max_depth = path->max_depth * 2 + 64;
+		path->nodes = realloc(path->nodes, path->max_depth * sizeof *path->nodes);
+		path->hashes = realloc(path->hashes, path->max_depth * sizeof *path->hashes);
+		if (path->nodes == NULL || path->hashes == NULL) {
+			perror("realloc");
+			exit(1);
+		}
+	}
+	
+	path->nodes[path->depth] = node;
+	path->hashes[path->depth] = path->chess.hash;
+	path->depth++;
+}
+
+/* whether the position at the end of the path is a draw (by repetition or by the fifty-move rule) */
+/* (a single repetition is enough, since the same moves could just be played again) */
+static int moonfish_drawn(struct moonfish_root *root, struct moonfish_path *path)
+{
+	struct moonfish_move moves[256];
+	int i, j;
+	
+	/* (checkmate still takes precedence over the fifty-move rule) */
+	if (path->chess.clock >= 100) return !moonfish_check(&path->chess) || moonfish_legal_moves(&path->chess, moves) > 0;
+	
+	/* only positions since the last capture or pawn move (with the same player to move) could be the same */
+	for (i = 4 ; i <= path->chess.clock ; i += 2) {
+		j = path->depth - 1 - i;
+		if (j >= 0) {
+			if (path->hashes[j] == path->chess.hash) return 1;
+			continue;
+		}
+		j += root->history_count;
+		if (j < 0) break;
+		if (root->history[j] == path->chess.hash) return 1;
+	}
+	
+	return 0;
+}
+
+/* undoes the pending visits along the path */
+static void moonfish_unwind(struct moonfish_path *path)
+{
+	while (path->depth > 1) {
+		path->depth--;
+#ifdef moonfish_no_threads
+		path->nodes[path->depth]->pending--;
+#else
+		atomic_fetch_add(&path->nodes[path->depth]->pending, -1);
+#endif
+	}
+}
+
+/* stores the path to a leaf (and its position) in the given path, then returns the leaf */
+/* the leaf is either a node to be expanded (already claimed by the worker) or a node drawn through this path */
+/* nodes below shared children might be reached through different paths, so they can't just be marked as drawn like other leaves */
+/* (instead, they are checked every time they are reached, and their scores are not trusted when they are drawn through the path taken) */
+/* when "batched" is set, this gives up (returning null) instead of waiting for other nodes to be expanded */
+/* (since the worker itself might be the one that is going to expand them) */
+static struct moonfish_node *moonfish_select(struct moonfish_worker *worker, struct moonfish_path *path, int batched)
+{
+	struct moonfish_root *root;
+	struct moonfish_node *node, *next;
+	double max_confidence, confidence, log_visits;
+	int i, count;
+	int shared;
+#ifndef moonfish_mini
+	struct moonfish_chess before;
+#endif
+	
+	root = worker->root;
+	node = &root->node;
+	path->chess = root->chess;
+	path->drawn = 0;
+	shared = 0;
+	
+	path->depth = 0;
+	moonfish_push(path, node);
+	
+#ifndef moonfish_mini
+	if (root->network != NULL) moonfish_accumulate(root, path, NULL);
+#endif
+	
+	for (;;) {
+		
+		if (shared && moonfish_drawn(root, path)) {
+			path->drawn = 1;
+			return node;
+		}
+		
+#ifdef moonfish_no_threads
+		count = node->count;
+		if (count == 0) {
+			node->count = -1;
+			return node;
+		}
+#else
+		count = 0;
+		if (atomic_compare_exchange_strong(&node->count, &count, -1)) return node;
+#endif
+		
+		next = NULL;
+		max_confidence = -1;
+		log_visits = log(node->visits);
+		
+		for (i = 0 ; i < count ; i++) {
+			if (node->children[i].ignored) continue;
+			if (node->children[i].count == -1) continue;
+			confidence = moonfish_confidence(node->children + i, log_visits, root->virtual_loss);
+			if (confidence > max_confidence) {
+				next = node->children + i;
+				max_confidence = confidence;
+			}
+		}
+		
+		if (next == NULL && batched) {
+			moonfish_unwind(path);
+			return NULL;
+		}
+		
+#ifdef moonfish_no_threads
+		
+		next->pending++;
+		
+#else
+		
+		/* the node (or each of its children) is being expanded by another thread */
+		/* so rather than waiting for it, start over from the root and take a different path */
+		/* (unless there is nowhere else to go, in which case just let the other threads run for a bit) */
+		if (next == NULL) {
+			if (node == &root->node) {
+				worker->wait_count++;
+				thrd_yield();
+				continue;
+			}
+			worker->retry_count++;
+			moonfish_unwind(path);
+			node = &root->node;
+			path->chess = root->chess;
+			shared = 0;
+			continue;
+		}
+		
+		atomic_fetch_add(&next->pending, 1);
+		
+#endif
+		
+		if (node->shared) shared = 1;
+		node = next;
+		
+#ifndef moonfish_mini
+		if (root->network != NULL) {
+			before = path->chess;
+			moonfish_node_chess(node, &path->chess);
+			moonfish_push(path, node);
+			moonfish_accumulate(root, path, &before);
+			continue;
+		}
+#endif
+		
+		moonfish_node_chess(node, &path->chess);
+		moonfish_push(path, node);
+	}
+}
+
+static int moonfish_best_score(struct moonfish_node *node)
+{
+	int i;
+	int score, child_score;
+	
+	score = node->count == 0 ? 0 : SHRT_MIN;
+	for (i = 0 ; i < node->count ; i++) {
+		child_score = -node->children[i].score;
+		if (score < child_score) score = child_score;
+	}
+	
+	return score;
+}
+
+static int moonfish_swap_score(struct moonfish_node *node, int *score, int new_score)
+{
+#ifdef moonfish_no_threads
+	if (node->score != *score) {
+		*score = node->score;
+		return 0;
+	}
+	node->score = new_score;
+	return 1;
+#else
+	return atomic_compare_exchange_strong(&node->score, score, new_score);
+#endif
+}
+
+/* recomputes the node's score from all of its children, returning the new score */
+/* (it is only settled once a scan agrees with the stored score) */
+/* (so any child updated concurrently is either seen by the final scan, or sees the final score when updating the node itself) */
+static int moonfish_rescan(struct moonfish_node *node)
+{
+	int score, best_score;
+	
+	score = node->score;
+	for (;;) {
+		best_score = moonfish_best_score(node);
+		if (best_score == score) return score;
+		if (moonfish_swap_score(node, &score, best_score)) score = best_score;
+	}
+}
+
+/* updates the node's score after the score of one of its children changed from "-old_score" to "-new_score" */
+/* (this only scans all of the children when the child was the best one, and is no longer) */
+/* returns whether the node's score changed (and if so, stores its old score in "old_score" and new score in "new_score") */
+static int moonfish_rescore(struct moonfish_node *node, int *old_score, int *new_score)
+{
+	int score;
+	
+	for (;;) {
+		
+		score = node->score;
+		
+		if (*new_score > score) {
+			if (!moonfish_swap_score(node, &score, *new_score)) continue;
+			*old_score = score;
+			return 1;
+		}
+		
+		if (*old_score != score || *new_score == score) return 0;
+		
+		*old_score = score;
+		*new_score = moonfish_rescan(node);
+		return *new_score != score;
+	}
+}
+
+/* backs up the score of the last node of the path (which was "old_score" before) to the root, and counts the visit on the whole path */
+/* (when the last node is drawn through the path, its own score is left as is, and a draw is backed up instead) */
+static void moonfish_propagate(struct moonfish_path *path, int old_score)
+{
+	struct moonfish_node *node;
+	int changed;
+	int new_score;
+	int drawn;
+	int i;
+	
+	i = path->depth - 1;
+	node = path->nodes[i];
+	drawn = path->drawn;
+	new_score = drawn ? 0 : node->score;
+	changed = new_score != old_score;
+	
+	for (;;) {
+		
+#ifdef moonfish_no_threads
+		node->visits++;
+		if (i > 0) node->pending--;
+#else
+		atomic_fetch_add(&node->visits, 1);
+		if (i > 0) atomic_fetch_add(&node->pending, -1);
+#endif
+		
+		if (i == 0) break;
+		node = path->nodes[--i];
+		
+		/* nodes with shared children are always rescanned, since their children might have been updated through a transposition */
+		/* (except right above a drawn leaf, since rescanning would just take its score back) */
+		if (node->shared && !drawn) {
+			old_score = node->score;
+			new_score = moonfish_rescan(node);
+			changed = new_score != old_score;
+			continue;
+		}
+		
+		drawn = 0;
+		if (!changed) continue;
+		
+		old_score = -old_score;
+		new_score = -new_score;
+		changed = moonfish_rescore(node, &old_score, &new_score);
+	}
+}
+
+static void moonfish_propagate_bounds(struct moonfish_path *path)
+{
+	struct moonfish_node *node;
+	int i, j, k;
+	int bound;
+	
+	i = 1;
+	for (k = path->depth - 1 ; k >= 0 ; k--) {
+		node = path->nodes[k];
+		bound = 0;
+		for (j = 0 ; j < node->count ; j++) {
+			if (1 - node->children[j].bounds[1 - i] > bound) {
+				bound = 1 - node->children[j].bounds[1 - i];
+			}
+		}
+		for (j = 0 ; j < node->count ; j++) {
+			if (1 - node->children[j].bounds[1 - i] < bound) {
+				node->children[j].ignored = 1;
+			}
+		}
+		node->bounds[i] = bound;
+		i = 1 - i;
+	}
+}
+
+/* (note: subtrees shared with transpositions are only ever discarded as a whole) */
+static long int moonfish_prune(struct moonfish_node *node, int threshold)
+{
+	long int count;
+	int i;
+	
+	count = 0;
+	for (i = 0 ; i < node->count ; i++) {
+		if (node->children[i].visits < threshold) count += moonfish_discard(node->children + i);
+		else if (!node->children[i].shared) count += moonfish_prune(node->children + i, threshold);
+	}
+	
+	return count;
+}
+
+static long int moonfish_allocated(struct moonfish_root *root)
+{
+	long int count;
+	int i;
+	
+	count = 0;
+	for (i = 0 ; i < root->worker_count ; i++) count += root->workers[i]->arena.node_count;
+	
+	return count;
+}
+
+/* discards the least visited subtrees until at most the given number of nodes are left, then reclaims their memory */
+static void moonfish_recycle(struct moonfish_root *root, long int count)
+{
+	int threshold;
+	
+	threshold = 2;
+	while (moonfish_allocated(root) - root->garbage > count && threshold <= root->node.visits) {
+		root->garbage += moonfish_prune(&root->node, threshold);
+		threshold *= 2;
+	}
+	
+	moonfish_collect(root);
+}
+
+/* makes sure the tree fits within the maximum number of chunks */
+/* (the tree is only allowed to grow up to two thirds of it, since moving it into fresh chunks takes up memory too) */
+static int moonfish_full(struct moonfish_root *root)
+{
+	return root->max_chunks > 0 && root->chunk_count * 3L >= root->max_chunks * 2;
+}
+
+static void moonfish_limit(struct moonfish_root *root)
+{
+	moonfish_recycle(root, root->max_chunks / 3 * (long int) (sizeof (struct moonfish_chunk) / sizeof (struct moonfish_node)));
+}
+
+#ifndef moonfish_no_threads
+
+static void moonfish_park(struct moonfish_root *root)
+{
+	mtx_lock(&root->mutex);
+	root->parked++;
+	cnd_broadcast(&root->condition);
+	while (root->pause) cnd_wait(&root->condition, &root->mutex);
+	root->parked--;
+	mtx_unlock(&root->mutex);
+}
+
+/* the first worker to notice that the tree is full waits for every other worker to park, then recycles the tree on its own */
+static void moonfish_maintain(struct moonfish_root *root)
+{
+	int pause;
+	
+	pause = 0;
+	if (!atomic_compare_exchange_strong(&root->pause, &pause, 1)) {
+		moonfish_park(root);
+		return;
+	}
+	
+	mtx_lock(&root->mutex);
+	while (root->parked < root->running - 1) cnd_wait(&root->condition, &root->mutex);
+	if (moonfish_full(root)) moonfish_limit(root);
+	root->pause = 0;
+	cnd_broadcast(&root->condition);
+	mtx_unlock(&root->mutex);
+}
+
+#endif
+
+static void moonfish_paths(struct moonfish_worker *worker, int count)
+{
+	struct moonfish_path *path;
+	
+	worker->paths = realloc(worker->paths, count * sizeof *worker->paths);
+	if (worker->paths == NULL) {
+		perror("realloc");
+		exit(1);
+	}
+	
+	while (worker->path_count < count) {
+		path = worker->paths + worker->path_count++;
+		path->nodes = NULL;
+		path->hashes = NULL;
+		path->depth = 0;
+		path->max_depth = 0;
+#ifndef moonfish_mini
+		path->accumulators = NULL;
+		path->accumulator_count = 0;
+#endif
+	}
+}
+
+/* a batch of leaves is selected first (with each of them counting as a pending visit, so that they are all different) */
+/* then all of them are expanded, and only then their scores are propagated */
+static void moonfish_iterate(struct moonfish_worker *worker)
+{
+	struct moonfish_root *root;
+	struct moonfish_node *leaf;
+	struct moonfish_path *path;
+	int i, count;
+#ifdef moonfish_statistics
+	double time, now, score_time;
+#endif
+	
+	root = worker->root;
+	
+#ifndef moonfish_no_threads
+	if (root->pause) moonfish_park(root);
+#endif
+	
+	if (worker->path_count < root->batch) moonfish_paths(worker, root->batch);
+	
+#ifdef moonfish_statistics
+	time = moonfish_nanoseconds();
+#endif
+	
+	/* (the batch is cut short rather than going over the node limit) */
+	for (count = 0 ; count < root->batch && (count == 0 || root->node.visits + count < root->node_count) ; count++) {
+		path = worker->paths + count;
+		leaf = moonfish_select(worker, path, count > 0);
+		if (leaf == NULL) break;
+		path->score = leaf->score;
+	}
+	
+#ifdef moonfish_statistics
+	now = moonfish_nanoseconds();
+	worker->stats.select_time += now - time;
+	time = now;
+	score_time = worker->stats.score_time;
+	for (i = 0 ; i < count ; i++) {
+		if (worker->paths[i].depth > 32) worker->stats.depths[31]++;
+		else worker->stats.depths[worker->paths[i].depth - 1]++;
+	}
+#endif
+	
+	for (i = 0 ; i < count ; i++) {
+		
+		path = worker->paths + i;
+		leaf = path->nodes[path->depth - 1];
+		if (path->drawn) continue;
+		
+		/* drawn positions are not expanded (they are left as leaves, like checkmate and stalemate) */
+		if (path->depth > 1 && moonfish_drawn(root, path)) {
+			leaf->score = 0;
+			leaf->count = 0;
+			continue;
+		}
+		
+		moonfish_expand(worker, path);
+		if (leaf->count == 0 && moonfish_check(&path->chess)) moonfish_propagate_bounds(path);
+	}
+	
+#ifdef moonfish_statistics
+	/* (the time spent scoring children is counted separately) */
+	now = moonfish_nanoseconds();
+	worker->stats.expand_time += now - time - (worker->stats.score_time - score_time);
+	time = now;
+#endif
+	
+	for (i = 0 ; i < count ; i++) moonfish_propagate(worker->paths + i, worker->paths[i].score);
+	
+#ifdef moonfish_statistics
+	worker->stats.propagate_time += moonfish_nanoseconds() - time;
+#endif
+	
+	/* the workers stop on their own once there is nothing left to search */
+	/* (so that the amount of work done doesn't depend on timing when possible) */
+	if (root->node.visits >= root->node_count) root->halt = 1;
+	count = root->node.count;
+	if (count > 0) {
+		for (i = 0 ; i < root->node.count ; i++) {
+			if (root->node.children[i].ignored) count--;
+		}
+		if (count <= 1) root->halt = 1;
+	}
+	
+	if (moonfish_full(root)) {
+#ifdef moonfish_no_threads
+		moonfish_limit(root);
+#else
+		moonfish_maintain(root);
+#endif
+	}
+}
+
+#ifndef moonfish_no_threads
+
+static void moonfish_search(struct moonfish_worker *worker)
+{
+	do moonfish_iterate(worker);
+	while (!worker->root->halt);
+}
+
+/* workers are long-lived, they wait for a search request, search until halted, then wait again */
+static moonfish_result_t moonfish_work(void *data)
+{
+	struct moonfish_worker *worker;
+	struct moonfish_root *root;
+	
+	worker = data;
+	root = worker->root;
+	
+	mtx_lock(&root->mutex);
+	
+	for (;;) {
+		while (worker->generation == root->generation) cnd_wait(&root->condition, &root->mutex);
+		worker->generation = root->generation;
+		if (root->quit) break;
+		if (worker->index >= root->active) continue;
+		mtx_unlock(&root->mutex);
+		moonfish_search(worker);
+		mtx_lock(&root->mutex);
+		root->running--;
+		cnd_broadcast(&root->condition);
+	}
+	
+	mtx_unlock(&root->mutex);
+	return moonfish_value;
+}
+
+#endif
+
+static void moonfish_workers(struct moonfish_root *root, int count)
+{
+	struct moonfish_worker *worker;
+	
+	if (count <= root->worker_count) return;
+	
+	root->workers = realloc(root->workers, count * sizeof *root->workers);
+	if (root->workers == NULL) {
+		perror("realloc");
+		exit(1);
+	}
+	
+	while (root->worker_count < count) {
+		
+		worker = malloc(sizeof *worker);
+		if (worker == NULL) {
+			perror("malloc");
+			exit(1);
+		}
+		
+		worker->root = root;
+		worker->arena.chunks = NULL;
+		worker->arena.used = 0;
+		worker->arena.node_count = 0;
+		worker->arena.allocation_count = 0;
+		worker->arena.chunk_count = 0;
+		worker->paths = NULL;
+		worker->path_count = 0;
+		
+#ifndef moonfish_no_threads
+		worker->index = root->worker_count;
+		worker->generation = root->generation;
+		if (thrd_create(&worker->thread, &moonfish_work, worker) != thrd_success) {
+			fprintf(stderr, "could not create thread\n");
+			exit(1);
+		}
+#endif
+		
+		root->workers[root->worker_count++] = worker;
+	}
+}
+
+/* sets up the entries for transpositions (about one for every eight nodes that fit in memory) */
+/* (note: these are not included in the maximum memory) */
+static void moonfish_entries(struct moonfish_root *root, int transpositions)
+{
+	long int count, max_count;
+	
+	count = 0;
+	if (transpositions) {
+		max_count = 0x100000;
+		if (root->max_chunks > 0) max_count = root->max_chunks * (long int) (sizeof (struct moonfish_chunk) / sizeof (struct moonfish_node)) / 8;
+		count = 8;
+		while (count * 2 <= max_count) count *= 2;
+	}
+	
+	if (count == root->entry_count) return;
+	
+	free(root->entries);
+	root->entries = NULL;
+	root->entry_count = count;
+	if (count == 0) return;
+	
+	root->entries = calloc(count, sizeof *root->entries);
+	if (root->entries == NULL) {
+		perror("calloc");
+		exit(1);
+	}
+}
+
+/* finds the best move by scanning the root's children (they are not kept sorted) */
+static void moonfish_report(struct moonfish_root *root, struct moonfish_result *result, long int time0)
+{
+	struct moonfish_node *best;
+	int i;
+	
+	best = root->node.children;
+	for (i = 1 ; i < root->node.count ; i++) {
+		if (moonfish_compare(root->node.children + i, best) < 0) best = root->node.children + i;
+	}
+	
+	result->move = best->move;
+	result->score = root->node.score;
+	result->node_count = root->node.visits;
+	result->time = moonfish_clock() - time0;
+	result->hashfull = -1;
+	if (root->max_chunks > 0) result->hashfull = root->chunk_count * 1000L / root->max_chunks;
+}
+
+void moonfish_best_move(struct moonfish_root *root, struct moonfish_result *result, struct moonfish_options *options)
+{
+	long int time, time0;
+	int i;
+#ifndef moonfish_no_threads
+	static struct timespec interval = {0, 10000000};
+	int thread_count, poll;
+#ifndef moonfish_mini
+	long int time1;
+#endif
+#endif
+	
+	time = LONG_MAX;
+	if (options->our_time >= 0) time = options->our_time / 16;
+	if (options->max_time >= 0 && time > options->max_time) time = options->max_time;
+	time -= time / 32 + 125;
+	if (time < 0) time = 0;
+	
+	time0 = moonfish_clock();
+	root->node_count = options->node_count;
+	if (root->node_count < 0) root->node_count = LONG_MAX;
+	
+	root->virtual_loss = options->virtual_loss;
+	root->batch = options->batch;
+	if (root->batch < 1) root->batch = 1;
+	
+	root->max_chunks = 0;
+	if (options->max_memory > 0) root->max_chunks = options->max_memory * 1048576.0 / sizeof (struct moonfish_chunk);
+	
+	/* nodes discarded since the last search are reclaimed once they make up half of the tree's memory */
+	/* (rather than every time the root changes, since that would move the whole tree for every move played) */
+	if (moonfish_full(root)) moonfish_limit(root);
+	else if (root->garbage * 2 > moonfish_allocated(root)) moonfish_collect(root);
+	
+	moonfish_entries(root, options->transpositions);
+	
+#ifndef moonfish_mini
+	if (root->network != NULL) moonfish_refresh(root->network, root->accumulator, &root->chess);
+#endif
+	
+	root->halt = 0;
+	result->retry_count = 0;
+	result->wait_count = 0;
+	
+#ifdef moonfish_no_threads
+	
+	moonfish_workers(root, 1);
+	
+#ifdef moonfish_statistics
+	memset(&root->workers[0]->stats, 0, sizeof root->workers[0]->stats);
+#endif
+	
+	for (;;) {
+		for (i = 0 ; i < 1024 && !root->halt ; i++) moonfish_iterate(root->workers[0]);
+#ifndef moonfish_mini
+		if (root->stop) root->halt = 1;
+#endif
+		if (moonfish_clock() - time0 >= time) root->halt = 1;
+		if (root->halt) break;
+#ifndef moonfish_mini
+		moonfish_report(root, result, time0);
+		if (root->log != NULL) (*root->log)(result, root->data);
+#endif
+	}
+	
+#else
+	
+	thread_count = options->thread_count;
+	if (thread_count < 1) thread_count = 1;
+	moonfish_workers(root, thread_count);
+	
+	for (i = 0 ; i < root->worker_count ; i++) {
+		root->workers[i]->retry_count = 0;
+		root->workers[i]->wait_count = 0;
+#ifdef moonfish_statistics
+		memset(&root->workers[i]->stats, 0, sizeof root->workers[i]->stats);
+#endif
+	}
+	
+	mtx_lock(&root->mutex);
+	root->active = thread_count;
+	root->running = thread_count;
+	root->generation++;
+	cnd_broadcast(&root->condition);
+	mtx_unlock(&root->mutex);
+	
+	poll = 1;
+	
+#ifndef moonfish_mini
+	time1 = time0;
+	/* when the search can only end on its own and there is nothing to log, this thread just waits for the workers */
+	/* (so that the time taken isn't rounded up to the polling interval, which would distort short searches, like the ones from "bench") */
+	if (options->our_time < 0 && options->max_time < 0 && options->node_count >= 0 && root->log == NULL) poll = 0;
+#endif
+	
+	/* the workers search on their own, meanwhile this thread only checks whether to stop and logs every once in a while */
+	while (poll && !root->halt) {
+		thrd_sleep(&interval, NULL);
+#ifndef moonfish_mini
+		if (root->stop) root->halt = 1;
+#endif
+		if (moonfish_clock() - time0 >= time) root->halt = 1;
+#ifndef moonfish_mini
+		if (root->halt || root->log == NULL || moonfish_clock() - time1 < 100) continue;
+		time1 = moonfish_clock();
+		mtx_lock(&root->mutex);
+		if (root->node.count > 0) {
+			moonfish_report(root, result, time0);
+			(*root->log)(result, root->data);
+		}
+		mtx_unlock(&root->mutex);
+#endif
+	}
+	
+	mtx_lock(&root->mutex);
+	while (root->running > 0) cnd_wait(&root->condition, &root->mutex);
+	mtx_unlock(&root->mutex);
+	
+	for (i = 0 ; i < root->worker_count ; i++) {
+		result->retry_count += root->workers[i]->retry_count;
+		result->wait_count += root->workers[i]->wait_count;
+	}
+	
+#endif
+	
+	moonfish_report(root, result, time0);
+#ifndef moonfish_mini
+	if (root->log != NULL) (*root->log)(result, root->data);
+#endif
+}
+
+/* the discarded nodes are only reclaimed by the next search (see "moonfish_best_move") */
+/* (they are not walked through, their number is estimated from the share of the visits that is discarded, since each visit expands about one node) */
+void moonfish_reroot(struct moonfish_root *root, struct moonfish_chess *chess)
+{
+	static struct moonfish_chess chess0;
+	
+	int i;
 	
 	for (i = 0 ; i < root->node.count ; i++) {
-		root->node.children[i].parent = &root->node;
+		chess0 = root->chess;
+		moonfish_node_chess(root->node.children + i, &chess0);
+		if (moonfish_equal(&chess0, chess)) break;
 	}
+	
+	root->chess = *chess;
+	root->history_count = 0;
+	
+	if (i >= root->node.count) {
+		root->garbage = moonfish_allocated(root);
+		moonfish_node(&root->node);
+		return;
+	}
+	
+	if (root->node.visits > 0) root->garbage += (moonfish_allocated(root) - root->garbage) * (1 - (double) root->node.children[i].visits / root->node.visits);
+	root->node = root->node.children[i];
 }
 
 void moonfish_root(struct moonfish_root *root, struct moonfish_chess *chess)
@@ -462,10 +1534,34 @@ struct moonfish_root *moonfish_new(void)
 		exit(1);
 	}
 	
+	moonfish_winrate();
+	
 #ifndef moonfish_mini
 	root->log = NULL;
 	root->stop = 0;
+	root->network = NULL;
+	root->accumulator = NULL;
 #endif
+	root->workers = NULL;
+	root->worker_count = 0;
+	root->garbage = 0;
+	root->collection_count = 0;
+	root->chunk_count = 0;
+	root->entries = NULL;
+	root->entry_count = 0;
+	root->history_count = 0;
+	
+#ifndef moonfish_no_threads
+	if (mtx_init(&root->mutex, mtx_plain) != thrd_success || cnd_init(&root->condition) != thrd_success) {
+		fprintf(stderr, "could not initialise thread synchronisation\n");
+		exit(1);
+	}
+	root->generation = 0;
+	root->parked = 0;
+	root->quit = 0;
+	root->pause = 0;
+#endif
+	
 	moonfish_node(&root->node);
 	moonfish_chess(&root->chess);
 	
@@ -474,12 +1570,232 @@ struct moonfish_root *moonfish_new(void)
 
 #ifndef moonfish_mini
 
+void moonfish_history(struct moonfish_root *root, moonfish_bitboard *hashes, int count)
+{
+	int i;
+	
+	/* only the most recent positions are kept (older ones are too far back to be repeated) */
+	i = 0;
+	if (count > (int) (sizeof root->history / sizeof *root->history)) i = count - sizeof root->history / sizeof *root->history;
+	
+	root->history_count = 0;
+	while (i < count) root->history[root->history_count++] = hashes[i++];
+}
+
+static void moonfish_unload(struct moonfish_root *root)
+{
+	if (root->network == NULL) return;
+	free(root->network->weights);
+	free(root->network);
+	free(root->accumulator);
+	root->network = NULL;
+	root->accumulator = NULL;
+}
+
+int moonfish_network(struct moonfish_root *root, char *name)
+{
+	FILE *file;
+	unsigned char *bytes;
+	size_t count, max_count, n;
+	long int i, value_count, size;
+	short int *values;
+	struct moonfish_network *network;
+	int j, k;
+	int error;
+	
+	network = NULL;
+	
+	if (name[0] != 0) {
+		
+		file = fopen(name, "rb");
+		if (file == NULL) return 1;
+		
+		bytes = NULL;
+		count = 0;
+		max_count = 0;
+		
+		for (;;) {
+			if (count == max_count) {
+				max_count = max_count * 2 + 65536;
+				bytes = realloc(bytes, max_count);
+				if (bytes == NULL) {
+					perror("realloc");
+					exit(1);
+				}
+			}
+			n = fread(bytes + count, 1, max_count - count, file);
+			if (n == 0) break;
+			count += n;
+		}
+		
+		if (ferror(file)) {
+			error = errno;
+			fclose(file);
+			free(bytes);
+			errno = error;
+			return 1;
+		}
+		
+		fclose(file);
+		
+		/* the file is a sequence of little-endian 16-bit values: the input weights, hidden biases, output weights, then the output bias */
+		/* (so it must have exactly "771 * size + 1" values) */
+		value_count = count / 2;
+		size = (value_count - 1) / 771;
+		if (count % 2 != 0 || size < 1 || size > 4096 || value_count != size * 771 + 1) {
+			free(bytes);
+			return 2;
+		}
+		
+		values = malloc(value_count * sizeof *values);
+		if (values == NULL) {
+			perror("malloc");
+			exit(1);
+		}
+		
+		for (i = 0 ; i < value_count ; i++) {
+			j = bytes[i * 2] | bytes[i * 2 + 1] << 8;
+			if (j >= 0x8000) j -= 0x10000;
+			values[i] = j;
+		}
+		
+		free(bytes);
+		
+		network = malloc(sizeof *network);
+		if (network == NULL) {
+			perror("malloc");
+			exit(1);
+		}
+		
+		network->size = size;
+		network->weights = values;
+		network->biases = values + size * 768;
+		network->output = network->biases + size;
+		network->bias = network->output[size * 2];
+	}
+	
+	moonfish_unload(root);
+	
+	if (network != NULL) {
+		root->accumulator = malloc(network->size * 2 * sizeof *root->accumulator);
+		if (root->accumulator == NULL) {
+			perror("malloc");
+			exit(1);
+		}
+	}
+	
+	root->network = network;
+	
+	/* the accumulators of the paths might have the wrong size now */
+	for (j = 0 ; j < root->worker_count ; j++) {
+		for (k = 0 ; k < root->workers[j]->path_count ; k++) {
+			free(root->workers[j]->paths[k].accumulators);
+			root->workers[j]->paths[k].accumulators = NULL;
+			root->workers[j]->paths[k].accumulator_count = 0;
+		}
+	}
+	
+	/* the scores in the tree came from the previous evaluation, so it is discarded */
+	moonfish_node(&root->node);
+	moonfish_collect(root);
+	
+	return 0;
+}
+
 void moonfish_finish(struct moonfish_root *root)
 {
-	moonfish_discard(&root->node);
+	int i, j;
+	
+#ifndef moonfish_no_threads
+	
+	mtx_lock(&root->mutex);
+	root->quit = 1;
+	root->generation++;
+	cnd_broadcast(&root->condition);
+	mtx_unlock(&root->mutex);
+	
+	for (i = 0 ; i < root->worker_count ; i++) {
+		if (thrd_join(root->workers[i]->thread, NULL) != thrd_success) {
+			fprintf(stderr, "could not join thread\n");
+			exit(1);
+		}
+	}
+	
+	mtx_destroy(&root->mutex);
+	cnd_destroy(&root->condition);
+	
+#endif
+	
+	for (i = 0 ; i < root->worker_count ; i++) {
+		moonfish_release(root->workers[i]->arena.chunks);
+		for (j = 0 ; j < root->workers[i]->path_count ; j++) {
+			free(root->workers[i]->paths[j].nodes);
+			free(root->workers[i]->paths[j].hashes);
+			free(root->workers[i]->paths[j].accumulators);
+		}
+		free(root->workers[i]->paths);
+		free(root->workers[i]);
+	}
+	
+	free(root->workers);
+	free(root->entries);
+	moonfish_unload(root);
 	free(root);
 }
 
+void moonfish_memory(struct moonfish_root *root, struct moonfish_memory *memory)
+{
+	struct moonfish_arena *arena;
+	int i;
+	
+	memory->node_count = 0;
+	memory->allocation_count = 0;
+	memory->chunk_count = 0;
+	memory->collection_count = root->collection_count;
+	
+	for (i = 0 ; i < root->worker_count ; i++) {
+		arena = &root->workers[i]->arena;
+		memory->node_count += arena->node_count;
+		memory->allocation_count += arena->allocation_count;
+		memory->chunk_count += arena->chunk_count;
+	}
+	
+	memory->byte_count = memory->chunk_count * (long int) sizeof (struct moonfish_chunk);
+}
+
+#ifdef moonfish_statistics
+
+int moonfish_stats(struct moonfish_root *root, struct moonfish_stats *stats, int index)
+{
+	struct moonfish_worker *worker;
+	int i, j;
+	
+	memset(stats, 0, sizeof *stats);
+	
+	for (i = 0 ; i < root->worker_count ; i++) {
+		
+		if (index >= 0 && i != index) continue;
+		worker = root->workers[i];
+		
+		for (j = 0 ; j < 32 ; j++) stats->depths[j] += worker->stats.depths[j];
+		stats->expansion_count += worker->stats.expansion_count;
+		stats->child_count += worker->stats.child_count;
+		stats->byte_count += worker->stats.byte_count;
+#ifndef moonfish_no_threads
+		stats->retry_count += worker->retry_count;
+		stats->wait_count += worker->wait_count;
+#endif
+		stats->select_time += worker->stats.select_time;
+		stats->expand_time += worker->stats.expand_time;
+		stats->score_time += worker->stats.score_time;
+		stats->propagate_time += worker->stats.propagate_time;
+	}
+	
+	return root->worker_count;
+}
+
+#endif
+
 void moonfish_stop(struct moonfish_root *root)
 {
 	root->stop = 1;
@@ -492,8 +1808,8 @@ void moonfish_unstop(struct moonfish_root *root)
 
 void moonfish_pv(struct moonfish_root *root, struct moonfish_move *moves, struct moonfish_result *result, int i, int *count)
 {
+	struct moonfish_node nodes[256];
 	struct moonfish_node *node;
-	struct moonfish_chess chess;
 	int j;
 	int best_score;
 	struct moonfish_node *best_node;
@@ -501,10 +1817,22 @@ void moonfish_pv(struct moonfish_root *root, struct moonfish_move *moves, struct
 	if (i >= root->node.count) *count = 0;
 	if (*count == 0) return;
 	
-	node = root->node.children + i;
-	chess = root->chess;
+	/* the root's children are not kept sorted, so they are ranked here */
+	/* (on a copy, since the workers might still be updating their scores) */
+	for (j = 0 ; j < root->node.count ; j++) {
+		node = root->node.children + j;
+		nodes[j].count = node->count;
+		if (nodes[j].count > 0) nodes[j].children = node->children;
+		nodes[j].visits = node->visits;
+		nodes[j].score = node->score;
+		nodes[j].ignored = node->ignored;
+		nodes[j].move = node->move;
+	}
+	
+	qsort(nodes, root->node.count, sizeof *nodes, &moonfish_compare);
+	node = nodes + i;
 	
-	moonfish_node_move(node, &chess, &result->move);
+	result->move = node->move;
 	result->score = -node->score;
 	result->node_count = node->visits;
 	
@@ -515,8 +1843,7 @@ void moonfish_pv(struct moonfish_root *root, struct moonfish_move *moves, struct
 			break;
 		}
 		
-		moonfish_node_move(node, &chess, moves + j);
-		moonfish_play(&chess, moves + j);
+		moves[j] = node->move;
 		
 		best_score = INT_MAX;
 		best_node = NULL;
@@ -50,13 +50,29 @@ static void atomic_fetch_add(int *pointer, int addend)
 #else
 
 #include <pthread.h>
+#include <sched.h>
 #define thrd_t pthread_t
 #define thrd_create(thread, fn, arg) pthread_create(thread, NULL, fn, arg)
 #define thrd_join pthread_join
+#define thrd_sleep nanosleep
+#define thrd_yield sched_yield
 #define moonfish_result_t void *
 #define moonfish_value NULL
 #define thrd_success 0
 
+#define mtx_t pthread_mutex_t
+#define mtx_plain 0
+#define mtx_init(mutex, type) pthread_mutex_init(mutex, NULL)
+#define mtx_lock pthread_mutex_lock
+#define mtx_unlock pthread_mutex_unlock
+#define mtx_destroy pthread_mutex_destroy
+
+#define cnd_t pthread_cond_t
+#define cnd_init(cond) pthread_cond_init(cond, NULL)
+#define cnd_wait pthread_cond_wait
+#define cnd_broadcast pthread_cond_broadcast
+#define cnd_destroy pthread_cond_destroy
+
 #endif
 
 #endif
@@ -3,36 +3,299 @@
 
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+#include <time.h>
 
 #include "../moonfish.h"
 #include "tools.h"
 
-static long int moonfish_perft(struct moonfish_chess *chess, int depth)
+/* a count stored for a position (to be reused when the same position is reached again) */
+/* entries are written without locks by all threads, so "check" stores the hash combined with "data" */
+/* that way, entries torn by concurrent writes are detected (and ignored) when they are read */
+struct moonfish_entry {
+	moonfish_bitboard check;
+	/* the count (shifted by eight bits) together with the depth */
+	moonfish_bitboard data;
+};
+
+struct moonfish_table {
+	struct moonfish_entry *entries;
+	/* (always a power of two, or zero when no table is used) */
+	size_t count;
+};
+
+/* a position whose count is computed by a single thread */
+struct moonfish_task {
+	struct moonfish_chess chess;
+	int depth;
+	long int perft;
+};
+
+/* the tasks are shared by all threads, each thread takes the next task not yet taken until there are none left */
+struct moonfish_pool {
+	struct moonfish_task *tasks;
+	int count, next;
+	pthread_mutex_t mutex;
+	struct moonfish_table table;
+	pthread_t *threads;
+	int thread_count;
+};
+
+static long int moonfish_perft(struct moonfish_table *table, struct moonfish_chess *chess, int depth)
 {
-	struct moonfish_move moves[32];
-	int x, y;
+	struct moonfish_move moves[256];
 	long int perft;
 	int i, count;
 	struct moonfish_chess other;
+	struct moonfish_entry *entry;
+	moonfish_bitboard check, data;
 	
 	if (depth == 0) return 1;
 	
+	entry = NULL;
+	if (table->count > 0 && depth > 1) {
+		entry = table->entries + (chess->hash & (table->count - 1));
+		check = entry->check;
+		data = entry->data;
+		if ((check ^ data) == chess->hash && (int) (data & 0xFF) == depth) return data >> 8;
+	}
+	
+	count = moonfish_legal_moves(chess, moves);
+	if (depth == 1) return count;
+	
 	perft = 0;
 	
-	for (y = 0 ; y < 8 ; y++) {
-		for (x = 0 ; x < 8 ; x++) {
-			count = moonfish_moves(chess, moves, (x + 1) + (y + 2) * 10);
-			for (i = 0 ; i < count ; i++) {
-				other = *chess;
-				moonfish_play(&other, moves + i);
-				if (!moonfish_validate(&other)) continue;
-				perft += moonfish_perft(&other, depth - 1);
+	for (i = 0 ; i < count ; i++) {
+		other = *chess;
+		moonfish_play(&other, moves + i);
+		perft += moonfish_perft(table, &other, depth - 1);
+	}
+	
+	if (entry != NULL) {
+		data = (moonfish_bitboard) perft << 8 | depth;
+		entry->check = chess->hash ^ data;
+		entry->data = data;
+	}
+	
+	return perft;
+}
+
+static long int moonfish_clock(void)
+{
+	struct timespec ts;
+	if (clock_gettime(CLOCK_MONOTONIC, &ts)) {
+		perror("clock_gettime");
+		exit(1);
+	}
+	return ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+static void *moonfish_alloc(size_t size)
+{
+	void *pointer;
+	
+	pointer = malloc(size);
+	if (pointer == NULL) {
+		perror("malloc");
+		exit(1);
+	}
+	
+	return pointer;
+}
+
+/* splits the position into the positions reachable from it, one ply at a time, until there are enough tasks for the threads to share */
+/* (so that threads that finish early can take more tasks, instead of waiting for the others) */
+static void moonfish_split(struct moonfish_pool *pool, struct moonfish_chess *chess, int depth, int thread_count)
+{
+	struct moonfish_move moves[256];
+	struct moonfish_task *tasks;
+	int i, j, count, move_count;
+	
+	pool->tasks = moonfish_alloc(sizeof *pool->tasks);
+	pool->tasks[0].chess = *chess;
+	pool->tasks[0].depth = depth;
+	pool->count = 1;
+	
+	while (pool->count < thread_count * 16 && depth > 2) {
+		
+		tasks = moonfish_alloc(pool->count * 256 * sizeof *tasks);
+		count = 0;
+		
+		for (i = 0 ; i < pool->count ; i++) {
+			move_count = moonfish_legal_moves(&pool->tasks[i].chess, moves);
+			for (j = 0 ; j < move_count ; j++) {
+				tasks[count].chess = pool->tasks[i].chess;
+				moonfish_play(&tasks[count].chess, moves + j);
+				tasks[count].depth = depth - 1;
+				count++;
 			}
 		}
+		
+		free(pool->tasks);
+		pool->tasks = tasks;
+		pool->count = count;
+		depth--;
+	}
+	
+	pool->next = 0;
+}
+
+static void *moonfish_work(void *data)
+{
+	struct moonfish_pool *pool;
+	struct moonfish_task *task;
+	
+	pool = data;
+	
+	for (;;) {
+		
+		pthread_mutex_lock(&pool->mutex);
+		task = NULL;
+		if (pool->next < pool->count) task = pool->tasks + pool->next++;
+		pthread_mutex_unlock(&pool->mutex);
+		
+		if (task == NULL) return NULL;
+		
+		task->perft = moonfish_perft(&pool->table, &task->chess, task->depth);
+	}
+}
+
+/* counts the positions reachable from the given position using all of the pool's threads */
+static long int moonfish_count(struct moonfish_pool *pool, struct moonfish_chess *chess, int depth)
+{
+	long int perft;
+	int i, error;
+	
+	moonfish_split(pool, chess, depth, pool->thread_count);
+	
+	for (i = 0 ; i < pool->thread_count ; i++) {
+		error = pthread_create(pool->threads + i, NULL, &moonfish_work, pool);
+		if (error) {
+			fprintf(stderr, "pthread_create: %s\n", strerror(error));
+			exit(1);
+		}
+	}
+	
+	for (i = 0 ; i < pool->thread_count ; i++) {
+		error = pthread_join(pool->threads[i], NULL);
+		if (error) {
+			fprintf(stderr, "pthread_join: %s\n", strerror(error));
+			exit(1);
+		}
 	}
+	
+	perft = 0;
+	for (i = 0 ; i < pool->count ; i++) perft += pool->tasks[i].perft;
+	
+	free(pool->tasks);
+	
 	return perft;
 }
 
+/* shows the count for each move of the given position (to help find which move the mismatch comes from) */
+static void moonfish_divide(struct moonfish_pool *pool, struct moonfish_chess *chess, int depth)
+{
+	struct moonfish_move moves[256];
+	struct moonfish_chess other;
+	char name[6];
+	int i, count;
+	
+	count = moonfish_legal_moves(chess, moves);
+	for (i = 0 ; i < count ; i++) {
+		other = *chess;
+		moonfish_play(&other, moves + i);
+		moonfish_to_uci(chess, moves + i, name);
+		printf("  %s: %ld\n", name, moonfish_count(pool, &other, depth - 1));
+	}
+}
+
+/* runs every position of an EPD file (with lines like "<FEN> ;D1 20 ;D2 400") up to the given depth */
+/* returns the number of counts that did not match the expected ones */
+static int moonfish_suite(struct moonfish_pool *pool, FILE *file, int max_depth)
+{
+	static char line[4096];
+	
+	struct moonfish_chess chess;
+	char *fen, *operation, *end;
+	int depth, line_count, position_count, mismatch_count;
+	long int perft, expected, time, total_time, total;
+	
+	line_count = 0;
+	position_count = 0;
+	mismatch_count = 0;
+	total_time = 0;
+	total = 0;
+	
+	while (fgets(line, sizeof line, file) != NULL) {
+		
+		line_count++;
+		
+		fen = line;
+		while (*fen == ' ' || *fen == '\t') fen++;
+		if (*fen == '#' || *fen == '\n' || *fen == '\r' || *fen == 0) continue;
+		
+		operation = strchr(fen, ';');
+		if (operation == NULL) {
+			fprintf(stderr, "missing expected counts on line %d\n", line_count);
+			exit(1);
+		}
+		
+		end = operation;
+		while (end > fen && (end[-1] == ' ' || end[-1] == '\t')) end--;
+		*end = 0;
+		
+		moonfish_chess(&chess);
+		if (moonfish_from_fen(&chess, fen)) {
+			fprintf(stderr, "malformed FEN on line %d\n", line_count);
+			exit(1);
+		}
+		
+		position_count++;
+		printf("position %d: %s\n", position_count, fen);
+		
+		time = moonfish_clock();
+		
+		for (operation = strtok(operation + 1, ";\r\n") ; operation != NULL ; operation = strtok(NULL, ";\r\n")) {
+			
+			if (sscanf(operation, " D%d %ld", &depth, &expected) != 2 || depth < 0) {
+				fprintf(stderr, "malformed expected count on line %d\n", line_count);
+				exit(1);
+			}
+			
+			if (max_depth >= 0 && depth > max_depth) continue;
+			
+			perft = moonfish_count(pool, &chess, depth);
+			total += perft;
+			
+			if (perft == expected) {
+				printf("perft %d: %ld\n", depth, perft);
+				continue;
+			}
+			
+			printf("perft %d: %ld, expected %ld\n", depth, perft, expected);
+			mismatch_count++;
+			if (depth > 0) moonfish_divide(pool, &chess, depth);
+		}
+		
+		time = moonfish_clock() - time;
+		total_time += time;
+		fflush(stdout);
+		fprintf(stderr, "time: %ld ms\n", time);
+	}
+	
+	if (ferror(file)) {
+		perror("fgets");
+		exit(1);
+	}
+	
+	printf("total: %d positions, %ld nodes, %d mismatches\n", position_count, total, mismatch_count);
+	fflush(stdout);
+	fprintf(stderr, "time: %ld ms (%.0f nodes per second)\n", total_time, total * 1000.0 / (total_time > 0 ? total_time : 1));
+	
+	return mismatch_count;
+}
+
 int main(int argc, char **argv)
 {
 	static struct moonfish_command cmd = {
@@ -40,25 +303,87 @@ int main(int argc, char **argv)
 		"<depth>",
 		{
 			{"F", "fen", "<FEN>", NULL, "starting position for the game"},
+			{"j", "jobs", "<count>", "1", "number of threads to count with"},
+			{"H", "hash", "<MB>", "0", "size of the table of counts shared by the threads (none when zero)"},
+			{"E", "epd", "<file>", NULL, "check the counts of every position in an EPD file (up to the given depth, if any)"},
+		},
+		{
+			{"-j 8 6", "count the positions six plies after the initial position using eight threads"},
+			{"-H 256 7", "count the positions seven plies after the initial position, reusing counts of transposed positions"},
+			{"-E scripts/perft.epd 4", "check the counts of the positions in 'scripts/perft.epd' up to four plies"},
+			{NULL, NULL},
 		},
-		{{NULL, NULL}},
 		{{NULL, NULL, NULL}},
-		{NULL},
+		{
+			"the time taken (and nodes per second) is shown on stderr",
+			"lines of EPD files look like '<FEN> ;D1 <count> ;D2 <count>' (with any number of depths)",
+			"when a count doesn't match the expected one, the count for each move is shown (to help find the mistake)",
+		},
 	};
 	
-	int depth;
+	static struct moonfish_pool pool;
+	
+	int depth, size, error;
 	struct moonfish_chess chess;
 	char **args2;
+	long int perft, time;
+	FILE *file;
 	
 	args2 = moonfish_args(&cmd, argc, argv);
-	if (args2 - argv != argc - 1) moonfish_usage(&cmd, argv[0]);
+	if (args2 - argv != argc - 1 && (cmd.args[3].value == NULL || args2 - argv != argc)) moonfish_usage(&cmd, argv[0]);
 	
-	if (moonfish_int(args2[0], &depth) || depth < 0) moonfish_usage(&cmd, argv[0]);
+	depth = -1;
+	if (args2 - argv != argc && (moonfish_int(args2[0], &depth) || depth < 0)) moonfish_usage(&cmd, argv[0]);
+	if (moonfish_int(cmd.args[1].value, &pool.thread_count) || pool.thread_count < 1) moonfish_usage(&cmd, argv[0]);
+	if (moonfish_int(cmd.args[2].value, &size) || size < 0) moonfish_usage(&cmd, argv[0]);
 	
 	moonfish_chess(&chess);
 	if (cmd.args[0].value != NULL && moonfish_from_fen(&chess, cmd.args[0].value)) moonfish_usage(&cmd, argv[0]);
 	
-	printf("perft %d: %ld\n", depth, moonfish_perft(&chess, depth));
+	/* the table's size is rounded down to a power of two */
+	pool.table.count = 0;
+	if (size > 0) {
+		pool.table.count = 1;
+		while (pool.table.count * 2 * sizeof *pool.table.entries <= size * 1048576.0) pool.table.count *= 2;
+		pool.table.entries = calloc(pool.table.count, sizeof *pool.table.entries);
+		if (pool.table.entries == NULL) {
+			perror("calloc");
+			return 1;
+		}
+	}
+	
+	error = pthread_mutex_init(&pool.mutex, NULL);
+	if (error) {
+		fprintf(stderr, "pthread_mutex_init: %s\n", strerror(error));
+		return 1;
+	}
+	
+	pool.threads = moonfish_alloc(pool.thread_count * sizeof *pool.threads);
+	
+	if (cmd.args[3].value != NULL) {
+		
+		file = fopen(cmd.args[3].value, "r");
+		if (file == NULL) {
+			perror("fopen");
+			return 1;
+		}
+		
+		error = moonfish_suite(&pool, file, depth);
+		fclose(file);
+	}
+	else {
+		
+		time = moonfish_clock();
+		perft = moonfish_count(&pool, &chess, depth);
+		time = moonfish_clock() - time;
+		
+		printf("perft %d: %ld\n", depth, perft);
+		fprintf(stderr, "time: %ld ms (%.0f nodes per second)\n", time, perft * 1000.0 / (time > 0 ? time : 1));
+	}
+	
+	free(pool.threads);
+	if (pool.table.count > 0) free(pool.table.entries);
+	pthread_mutex_destroy(&pool.mutex);
 	
-	return 0;
+	return error ? 1 : 0;
 }